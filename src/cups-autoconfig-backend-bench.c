@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2007 Novell, Inc. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, contact Novell, Inc.
+ *
+ * To contact Novell about this file by physical or electronic mail,
+ * you may find current contact information at www.novell.com.
+ *
+ */
+
+/*
+ * Backend output parser benchmark.  A corpus of backend device listings
+ * is parsed with parse_backend_output(), as run_backends() does, and
+ * with the strchr() version it replaced.  The corpus is also mutated at
+ * random and fed to the parser, which has to keep its fields inside
+ * the line it was given; run it under valgrind or ASan to catch reads
+ * past the end.
+ */
+
+#define main cups_autoconfig_main
+int main (int argc, char *argv[]);
+#include "cups-autoconfig.c"
+#undef main
+
+#define DEFAULT_ROUNDS 200
+#define DEFAULT_MUTATIONS 100000
+#define READ_SIZE 4096
+
+static const gchar *backends[] = { "usb", "hp", "epson", "canon" };
+
+/*
+ * The parser that was used before, which changes the line it's given.
+ */
+static PrinterInfo *reference_parse_backend_line (const gchar *backend, gchar *buff)
+{
+    PrinterInfo *pi;
+    gchar *start, *end, *uri, *p;
+    gsize uri_len;
+    gint i;
+
+    if (strncmp ("direct ", buff, 7))
+        return NULL;
+
+    start = buff + 7;
+    end = strstr (start, " ");
+    if (!end)
+        return NULL;
+
+    *end = '\0';
+
+    uri = g_strconcat (backend, ":/", NULL);
+    uri_len = strlen (uri);
+    if (strncmp (start, uri, uri_len)) {
+        g_free (uri);
+        return NULL;
+    }
+
+    g_free (uri);
+    pi = arena_alloc0 (sizeof (PrinterInfo));
+    pi->uri = arena_strdup (start);
+
+    start = strchr (end + 1, '"');
+    if (!start)
+        return NULL;
+
+    start++;
+    end = strchr (start + 1, '"');
+    if (!end)
+        return NULL;
+
+    *(end++) = '\0';
+    pi->make_and_model = arena_strdup (start);
+
+    /* it used to read past the end of lines that stop here */
+    if (*end == '\0')
+        return pi;
+
+    for (i = 0, p = end + 1; *p != '\0'; p++) {
+        if (*p != '"')
+            continue;
+
+        i++;
+        if (i == 3) {
+            start = p + 1;
+        } else if (i == 4) {
+            *p = '\0';
+            pi->device_id = arena_strdup (start);
+            parse_1284_id (pi->device_id, &pi->id);
+            break;
+        }
+    }
+
+    return pi;
+}
+
+static GPtrArray *load_corpus (const gchar *path)
+{
+    GPtrArray *corpus;
+    GError *err = NULL;
+    gchar *contents, **lines;
+    gint i;
+
+    if (!g_file_get_contents (path, &contents, NULL, &err)) {
+        g_printerr ("Failed to read '%s': %s\n", path, err->message);
+        g_error_free (err);
+        return NULL;
+    }
+
+    corpus = g_ptr_array_new ();
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        if (lines[i][0] == '#' || !lines[i][0])
+            continue;
+
+        g_ptr_array_add (corpus, g_strdup (lines[i]));
+    }
+
+    g_strfreev (lines);
+    g_free (contents);
+    return corpus;
+}
+
+static gdouble now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static PrinterInfo *parse_any_backend (const gchar *line, gsize len)
+{
+    PrinterInfo *pi = NULL;
+    gint i;
+
+    for (i = 0; !pi && i < G_N_ELEMENTS (backends); i++)
+        pi = parse_backend_line (backends[i], line, len);
+
+    return pi;
+}
+
+static PrinterInfo *reference_parse_any_backend (const gchar *line)
+{
+    PrinterInfo *ri = NULL;
+    gint i;
+
+    for (i = 0; !ri && i < G_N_ELEMENTS (backends); i++) {
+        gchar *copy = g_strdup (line);
+        ri = reference_parse_backend_line (backends[i], copy);
+        g_free (copy);
+    }
+
+    return ri;
+}
+
+static gboolean field_inside (const IdField *f, const gchar *line, gsize len)
+{
+    return !f->str || (f->str >= line && f->str + f->len <= line + len);
+}
+
+/*
+ * Parse a line that isn't NUL terminated and check that the fields
+ * stay inside it.
+ */
+static gboolean check_line (const gchar *line, gsize len)
+{
+    gchar *copy = g_memdup (line, len);
+    BackendDevice dev;
+    gboolean ok = TRUE;
+
+    if (parse_backend_device (copy, len, &dev)) {
+        ok = field_inside (&dev.dclass, copy, len) && field_inside (&dev.uri, copy, len) &&
+             field_inside (&dev.make_and_model, copy, len) && field_inside (&dev.info, copy, len) &&
+             field_inside (&dev.device_id, copy, len) && field_inside (&dev.location, copy, len);
+    }
+
+    parse_any_backend (copy, len);
+    g_free (copy);
+    return ok;
+}
+
+/*
+ * Change a line at random: cut it short, or put in quotes, backslashes,
+ * whitespace and newlines where they don't belong.
+ */
+static GString *mutate (GRand *rand, const gchar *line)
+{
+    static const gchar special[] = "\"\\ \t\n\r;:\0";
+    GString *s = g_string_new (line);
+    gint i, n = g_rand_int_range (rand, 1, 5);
+
+    for (i = 0; i < n && s->len; i++) {
+        gint pos = g_rand_int_range (rand, 0, s->len);
+
+        switch (g_rand_int_range (rand, 0, 5)) {
+        case 0:
+            g_string_truncate (s, pos);
+            break;
+        case 1:
+            s->str[pos] = special[g_rand_int_range (rand, 0, sizeof (special))];
+            break;
+        case 2:
+            g_string_insert_c (s, pos, special[g_rand_int_range (rand, 0, sizeof (special))]);
+            break;
+        case 3:
+            s->str[pos] = g_rand_int_range (rand, 1, 256);
+            break;
+        default:
+            g_string_erase (s, pos, MIN (g_rand_int_range (rand, 1, 16), s->len - pos));
+            break;
+        }
+    }
+
+    return s;
+}
+
+/*
+ * Feed the corpus to a backend probe rounds times, in reads of the
+ * size run_backends() uses.  Returns the time it took in seconds.
+ */
+static gdouble time_parser (const GString *stream, gint rounds, guint *printers)
+{
+    BackendProbe probe = { "usb" };
+    gdouble start = now ();
+    gint r;
+
+    for (r = 0; r < rounds; r++) {
+        gsize pos;
+
+        probe.buf = g_string_new (NULL);
+        probe.scanned = 0;
+        probe.printers = NULL;
+
+        for (pos = 0; pos < stream->len; pos += READ_SIZE) {
+            g_string_append_len (probe.buf, stream->str + pos, MIN (READ_SIZE, stream->len - pos));
+            parse_backend_output (&probe, FALSE);
+        }
+
+        parse_backend_output (&probe, TRUE);
+        *printers = g_slist_length (probe.printers);
+        g_slist_free (probe.printers);
+        g_string_free (probe.buf, TRUE);
+        arena_reset ();
+    }
+
+    return now () - start;
+}
+
+/*
+ * Run one of the parsers over each line of the corpus rounds times.
+ * Returns the time it took in seconds.
+ */
+static gdouble time_lines (GPtrArray *corpus, gint rounds, gint parser)
+{
+    gsize *lens = g_new (gsize, corpus->len);
+    gdouble start;
+    gint r;
+    guint i;
+
+    for (i = 0; i < corpus->len; i++)
+        lens[i] = strlen (g_ptr_array_index (corpus, i));
+
+    start = now ();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < corpus->len; i++) {
+            const gchar *line = g_ptr_array_index (corpus, i);
+            BackendDevice dev;
+
+            if (parser == 0) {
+                /* the old parser had a copy of the line from fgets() */
+                gchar *copy = g_strdup (line);
+
+                reference_parse_backend_line ("usb", copy);
+                g_free (copy);
+            } else if (parser == 1) {
+                parse_backend_device (line, lens[i], &dev);
+            } else {
+                parse_backend_line ("usb", line, lens[i]);
+            }
+        }
+
+        arena_reset ();
+    }
+
+    g_free (lens);
+    return now () - start;
+}
+
+static void print_rate (const gchar *what, gsize bytes, guint lines, gdouble secs, gdouble ref)
+{
+    g_print ("%-12s %8.1f MB/s %10.0f lines/s", what, bytes / secs / 1e6, lines / secs);
+    if (ref > 0)
+        g_print (" (%.1fx)", ref / secs);
+    g_print ("\n");
+}
+
+int main (int argc, char *argv[])
+{
+    GPtrArray *corpus;
+    GString *stream;
+    GRand *rand;
+    gint rounds = argc > 2 ? MAX (atoi (argv[2]), 1) : DEFAULT_ROUNDS;
+    gint mutations = argc > 3 ? atoi (argv[3]) : DEFAULT_MUTATIONS;
+    gint differ = 0, bad = 0, i;
+    guint printers = 0;
+    gdouble ref, fields, lines, streamed;
+
+    if (argc < 2) {
+        g_printerr ("usage: %s CORPUS [ROUNDS [MUTATIONS]]\n", argv[0]);
+        return 1;
+    }
+
+    corpus = load_corpus (argv[1]);
+    if (!corpus)
+        return 1;
+
+    log_level = LOG_LEVEL_ERROR;
+
+    /* the lines the old parser read differently */
+    stream = g_string_new (NULL);
+    for (i = 0; i < corpus->len; i++) {
+        const gchar *line = g_ptr_array_index (corpus, i);
+        PrinterInfo *pi = parse_any_backend (line, strlen (line));
+        PrinterInfo *ri = reference_parse_any_backend (line);
+
+        if (!pi != !ri || (pi && (strcmp (pi->uri, ri->uri) ||
+                                  strcmp (pi->make_and_model, ri->make_and_model) ||
+                                  strcmp (pi->device_id ? pi->device_id : "",
+                                          ri->device_id ? ri->device_id : "")))) {
+            g_print ("differs: %.60s%s\n", line, strlen (line) > 60 ? "..." : "");
+            differ++;
+        }
+
+        g_string_append (stream, line);
+        g_string_append_c (stream, '\n');
+    }
+
+    arena_reset ();
+
+    /* the parser mustn't stray outside mangled lines */
+    rand = g_rand_new_with_seed (1);
+    for (i = 0; i < mutations; i++) {
+        GString *s = mutate (rand, g_ptr_array_index (corpus, g_rand_int_range (rand, 0, corpus->len)));
+
+        if (!check_line (s->str, s->len))
+            bad++;
+
+        g_string_free (s, TRUE);
+        if (i % 1000 == 999)
+            arena_reset ();
+    }
+
+    g_rand_free (rand);
+    arena_reset ();
+
+    ref = time_lines (corpus, rounds, 0);
+    fields = time_lines (corpus, rounds, 1);
+    lines = time_lines (corpus, rounds, 2);
+    streamed = time_parser (stream, rounds, &printers);
+
+    g_print ("%u lines, %d parsed differently from the old parser\n", corpus->len, differ);
+    g_print ("%d mutated lines, %d read outside the line\n", mutations, bad);
+    g_print ("%u usb printers\n", printers);
+    print_rate ("old parser", stream->len * rounds, corpus->len * rounds, ref, 0);
+    print_rate ("fields", stream->len * rounds, corpus->len * rounds, fields, ref);
+    print_rate ("printers", stream->len * rounds, corpus->len * rounds, lines, ref);
+    print_rate ("4k reads", stream->len * rounds, corpus->len * rounds, streamed, ref);
+
+    return bad ? 1 : 0;
+}
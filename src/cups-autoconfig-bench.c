@@ -0,0 +1,1109 @@
+/*
+ * Copyright (c) 2007 Novell, Inc. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, contact Novell, Inc.
+ *
+ * To contact Novell about this file by physical or electronic mail,
+ * you may find current contact information at www.novell.com.
+ *
+ */
+
+/*
+ * Hotplug latency benchmark.  cups-autoconfig.c is built into this
+ * program together with three stand-ins: a mock cupsd that speaks IPP
+ * over HTTP on a local port, a fake libhal that knows about a synthetic
+ * fleet of printers, and scripted backends in LIBDIR/cups/backend.
+ * add_printers(), disable_printers() and migrate_hal_printers() are then
+ * timed against them, as is plugging printers in again after they've
+ * been unplugged.
+ *
+ * The program is built with its own LIBDIR and LOCALSTATEDIR (see
+ * Makefile.am) so it never touches the system's backends or caches.
+ */
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define main cups_autoconfig_main
+int main (int argc, char *argv[]);
+#include "cups-autoconfig.c"
+#undef main
+
+#define BENCH_BACKEND_DIR LIBDIR "/cups/backend"
+#define BENCH_USB_DEVICES BENCH_BACKEND_DIR "/usb.devices"
+#define MOCK_CHUNK_SIZE 4096
+
+/*
+ * A printer in the synthetic fleet.  attached says whether it's
+ * plugged in, i.e. whether HAL and the backends can see it.
+ */
+typedef struct _BenchPrinter {
+    gchar *udi;
+    const gchar *make;
+    gchar *model;
+    gchar *serial;
+    gchar *uri;
+    gchar *make_and_model;
+    gchar *device_id;
+    gboolean attached;
+} BenchPrinter;
+
+/*
+ * A print queue in the mock cupsd.
+ */
+typedef struct _BenchQueue {
+    gchar *name;
+    gchar *uri;
+    gchar *make_and_model;
+    gint state;
+} BenchQueue;
+
+typedef struct _BenchClient {
+    gint fd;
+    GString *in;
+    gboolean continued;
+} BenchClient;
+
+typedef struct _BenchBuffer {
+    const gchar *data;
+    gsize len;
+    gsize pos;
+} BenchBuffer;
+
+static const gchar *bench_makes[] = {
+    "HP", "EPSON", "Canon", "Brother", "Lexmark", "Samsung", "Xerox", "Ricoh"
+};
+
+static BenchPrinter *fleet;
+static gint n_fleet;
+static gint n_ppds;
+static gboolean use_backends;
+static GHashTable *fleet_by_udi;
+static GHashTable *queues;
+static gint mock_requests;
+static gsize arena_peak;
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static gint fake_hal;
+
+/*
+ * The fake libhal.  Only the calls cups-autoconfig makes are there,
+ * and they answer from the fleet.
+ */
+LibHalContext *libhal_ctx_new (void)
+{
+    return (LibHalContext *) &fake_hal;
+}
+
+dbus_bool_t libhal_ctx_set_dbus_connection (LibHalContext *ctx, DBusConnection *conn)
+{
+    return TRUE;
+}
+
+dbus_bool_t libhal_ctx_init (LibHalContext *ctx, DBusError *error)
+{
+    return TRUE;
+}
+
+dbus_bool_t libhal_ctx_shutdown (LibHalContext *ctx, DBusError *error)
+{
+    return TRUE;
+}
+
+dbus_bool_t libhal_ctx_free (LibHalContext *ctx)
+{
+    return TRUE;
+}
+
+dbus_bool_t libhal_ctx_set_device_added (LibHalContext *ctx, LibHalDeviceAdded callback)
+{
+    return TRUE;
+}
+
+dbus_bool_t libhal_ctx_set_device_removed (LibHalContext *ctx, LibHalDeviceRemoved callback)
+{
+    return TRUE;
+}
+
+char **libhal_find_device_by_capability (LibHalContext *ctx, const char *capability,
+                                         int *num_devices, DBusError *error)
+{
+    char **udis = g_new0 (char *, n_fleet + 1);
+    gint i;
+
+    *num_devices = 0;
+    for (i = 0; i < n_fleet; i++) {
+        if (fleet[i].attached)
+            udis[(*num_devices)++] = g_strdup (fleet[i].udi);
+    }
+
+    return udis;
+}
+
+dbus_bool_t libhal_device_query_capability (LibHalContext *ctx, const char *udi,
+                                            const char *capability, DBusError *error)
+{
+    return g_hash_table_lookup (fleet_by_udi, udi) != NULL;
+}
+
+/*
+ * A property set holds the string properties the fleet has.
+ */
+struct LibHalPropertySet_s {
+    const gchar *keys[3];
+    gchar *values[3];
+    guint n;
+};
+
+struct LibHalChangeSet_s {
+    gchar *udi;
+};
+
+LibHalPropertySet *libhal_device_get_all_properties (LibHalContext *ctx, const char *udi,
+                                                     DBusError *error)
+{
+    BenchPrinter *bp = g_hash_table_lookup (fleet_by_udi, udi);
+    LibHalPropertySet *set;
+
+    if (!bp)
+        return NULL;
+
+    set = g_new0 (LibHalPropertySet, 1);
+    set->keys[0] = "printer.vendor";
+    set->values[0] = g_strdup (bp->make);
+    set->keys[1] = "printer.product";
+    set->values[1] = g_strdup (bp->model);
+    set->keys[2] = "printer.serial";
+    set->values[2] = g_strdup (bp->serial);
+    set->n = 3;
+    return set;
+}
+
+void libhal_free_property_set (LibHalPropertySet *set)
+{
+    guint i;
+
+    for (i = 0; i < set->n; i++)
+        g_free (set->values[i]);
+    g_free (set);
+}
+
+void libhal_psi_init (LibHalPropertySetIterator *iter, LibHalPropertySet *set)
+{
+    iter->set = set;
+    iter->idx = 0;
+}
+
+dbus_bool_t libhal_psi_has_more (LibHalPropertySetIterator *iter)
+{
+    return iter->idx < iter->set->n;
+}
+
+void libhal_psi_next (LibHalPropertySetIterator *iter)
+{
+    iter->idx++;
+}
+
+LibHalPropertyType libhal_psi_get_type (LibHalPropertySetIterator *iter)
+{
+    return LIBHAL_PROPERTY_TYPE_STRING;
+}
+
+char *libhal_psi_get_key (LibHalPropertySetIterator *iter)
+{
+    return (char *) iter->set->keys[iter->idx];
+}
+
+char *libhal_psi_get_string (LibHalPropertySetIterator *iter)
+{
+    return iter->set->values[iter->idx];
+}
+
+LibHalChangeSet *libhal_device_new_changeset (const char *udi)
+{
+    LibHalChangeSet *cs = g_new0 (LibHalChangeSet, 1);
+
+    cs->udi = g_strdup (udi);
+    return cs;
+}
+
+dbus_bool_t libhal_changeset_set_property_bool (LibHalChangeSet *changeset, const char *key,
+                                                dbus_bool_t value)
+{
+    return TRUE;
+}
+
+dbus_bool_t libhal_changeset_set_property_string (LibHalChangeSet *changeset, const char *key,
+                                                  const char *value)
+{
+    return TRUE;
+}
+
+dbus_bool_t libhal_device_commit_changeset (LibHalContext *ctx, LibHalChangeSet *changeset,
+                                            DBusError *error)
+{
+    return g_hash_table_lookup (fleet_by_udi, changeset->udi) != NULL;
+}
+
+void libhal_device_free_changeset (LibHalChangeSet *changeset)
+{
+    g_free (changeset->udi);
+    g_free (changeset);
+}
+
+void libhal_free_string_array (char **str_array)
+{
+    g_strfreev (str_array);
+}
+
+/*
+ * Make the fleet.  Printer i is model "Model i" from one of the
+ * makes, and PPD i in the mock cupsd's catalog is for it.
+ */
+static void make_fleet (gint n)
+{
+    gint i;
+
+    fleet = g_new0 (BenchPrinter, n);
+    n_fleet = n;
+    fleet_by_udi = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (i = 0; i < n; i++) {
+        BenchPrinter *bp = &fleet[i];
+        gint m = i % G_N_ELEMENTS (bench_makes);
+
+        bp->udi = g_strdup_printf ("/org/freedesktop/Hal/devices/usb_device_bench_%d_printer", i);
+        bp->make = bench_makes[m];
+        bp->model = g_strdup_printf ("Model %d", i);
+        bp->serial = g_strdup_printf ("BENCH%06d", i);
+        bp->uri = g_strdup_printf ("usb://%s/Model%%20%d?serial=%s", bp->make, i, bp->serial);
+        bp->make_and_model = g_strdup_printf ("%s %s", bp->make, bp->model);
+        bp->device_id = g_strdup_printf ("MFG:%s;MDL:%s;CMD:PCL;SN:%s;",
+                                         bp->make, bp->model, bp->serial);
+        g_hash_table_insert (fleet_by_udi, bp->udi, bp);
+    }
+}
+
+/*
+ * Write the list of attached printers where the scripted usb backend
+ * prints it from.
+ */
+static void write_usb_devices (void)
+{
+    GString *out = g_string_new (NULL);
+    gint i;
+
+    for (i = 0; i < n_fleet; i++) {
+        BenchPrinter *bp = &fleet[i];
+
+        if (bp->attached)
+            g_string_append_printf (out, "direct %s \"%s\" \"%s USB\" \"%s\"\n",
+                                    bp->uri, bp->make_and_model, bp->make_and_model,
+                                    bp->device_id);
+    }
+
+    g_file_set_contents (BENCH_USB_DEVICES, out->str, out->len, NULL);
+    g_string_free (out, TRUE);
+}
+
+static void write_backends (void)
+{
+    const gchar *names[] = { "hp", "epson", "canon" };
+    gchar *path, *script;
+    gint i;
+
+    g_mkdir_with_parents (BENCH_BACKEND_DIR, 0755);
+
+    script = g_strdup_printf ("#!/bin/sh\ncat '%s'\n", BENCH_USB_DEVICES);
+    path = g_build_filename (BENCH_BACKEND_DIR, "usb", NULL);
+    g_file_set_contents (path, script, -1, NULL);
+    chmod (path, 0755);
+    g_free (path);
+    g_free (script);
+
+    /* the preferred backends don't find anything */
+    for (i = 0; i < G_N_ELEMENTS (names); i++) {
+        path = g_build_filename (BENCH_BACKEND_DIR, names[i], NULL);
+        g_file_set_contents (path, "#!/bin/sh\nexit 0\n", -1, NULL);
+        chmod (path, 0755);
+        g_free (path);
+    }
+
+    write_usb_devices ();
+}
+
+static void set_attached (BenchPrinter *bp, gboolean attached)
+{
+    bp->attached = attached;
+    if (use_backends)
+        write_usb_devices ();
+}
+
+static void free_queue (gpointer data)
+{
+    BenchQueue *q = data;
+
+    g_free (q->name);
+    g_free (q->uri);
+    g_free (q->make_and_model);
+    g_free (q);
+}
+
+static void add_queue (const gchar *name, const gchar *uri, const gchar *make_and_model)
+{
+    BenchQueue *q = g_new0 (BenchQueue, 1);
+
+    q->name = g_strdup (name);
+    q->uri = g_strdup (uri);
+    q->make_and_model = g_strdup (make_and_model);
+    q->state = IPP_PRINTER_IDLE;
+    g_hash_table_replace (queues, q->name, q);
+}
+
+static const gchar *queue_name_from_request (ipp_t *request)
+{
+    ipp_attribute_t *attr = ippFindAttribute (request, "printer-uri", IPP_TAG_URI);
+    const gchar *name;
+
+    if (!attr)
+        return NULL;
+
+    name = strrchr (attr->values[0].string.text, '/');
+    return name ? name + 1 : NULL;
+}
+
+/*
+ * The make and model of PPD i, which is also what cupsd reports as
+ * the printer-make-and-model of a queue using it.
+ */
+static gchar *ppd_make_and_model (gint i)
+{
+    return g_strdup_printf ("%s Model %d Foomatic/bench%s",
+                            bench_makes[i % G_N_ELEMENTS (bench_makes)], i,
+                            i % 3 ? "" : " (recommended)");
+}
+
+static void mock_get_ppds (ipp_t *request, ipp_t *response)
+{
+    ipp_attribute_t *attr = ippFindAttribute (request, "ppd-make", IPP_TAG_TEXT);
+    const gchar *make = attr ? attr->values[0].string.text : NULL;
+    gint i;
+
+    for (i = 0; i < n_ppds; i++) {
+        const gchar *ppd_make = bench_makes[i % G_N_ELEMENTS (bench_makes)];
+        gchar *str;
+
+        if (make && g_ascii_strcasecmp (make, ppd_make))
+            continue;
+
+        str = g_strdup_printf ("bench/%s-model-%d.ppd", ppd_make, i);
+        ippAddString (response, IPP_TAG_PRINTER, IPP_TAG_NAME, "ppd-name", NULL, str);
+        g_free (str);
+
+        ippAddString (response, IPP_TAG_PRINTER, IPP_TAG_TEXT, "ppd-make", NULL, ppd_make);
+
+        str = ppd_make_and_model (i);
+        ippAddString (response, IPP_TAG_PRINTER, IPP_TAG_TEXT, "ppd-make-and-model", NULL, str);
+        g_free (str);
+
+        /* only some PPDs have a device id, like in real life */
+        if (i % 2) {
+            str = g_strdup_printf ("MFG:%s;MDL:Model %d;", ppd_make, i);
+            ippAddString (response, IPP_TAG_PRINTER, IPP_TAG_TEXT, "ppd-device-id", NULL, str);
+            g_free (str);
+        }
+
+        ippAddSeparator (response);
+    }
+}
+
+static void add_queue_attrs (gpointer key, gpointer value, gpointer user_data)
+{
+    BenchQueue *q = value;
+    ipp_t *response = user_data;
+
+    ippAddString (response, IPP_TAG_PRINTER, IPP_TAG_NAME, "printer-name", NULL, q->name);
+    ippAddString (response, IPP_TAG_PRINTER, IPP_TAG_URI, "device-uri", NULL, q->uri);
+    ippAddString (response, IPP_TAG_PRINTER, IPP_TAG_TEXT, "printer-make-and-model",
+                  NULL, q->make_and_model);
+    ippAddInteger (response, IPP_TAG_PRINTER, IPP_TAG_ENUM, "printer-state", q->state);
+    ippAddSeparator (response);
+}
+
+static void mock_get_devices (ipp_t *response)
+{
+    gint i;
+
+    for (i = 0; i < n_fleet; i++) {
+        BenchPrinter *bp = &fleet[i];
+
+        if (!bp->attached)
+            continue;
+
+        ippAddString (response, IPP_TAG_PRINTER, IPP_TAG_KEYWORD, "device-class", NULL, "direct");
+        ippAddString (response, IPP_TAG_PRINTER, IPP_TAG_URI, "device-uri", NULL, bp->uri);
+        ippAddString (response, IPP_TAG_PRINTER, IPP_TAG_TEXT, "device-make-and-model",
+                      NULL, bp->make_and_model);
+        ippAddString (response, IPP_TAG_PRINTER, IPP_TAG_TEXT, "device-id", NULL, bp->device_id);
+        ippAddSeparator (response);
+    }
+}
+
+/*
+ * Answer a request the way cupsd would, as far as cups-autoconfig
+ * can tell.
+ */
+static ipp_status_t mock_dispatch (ipp_t *request, ipp_t *response)
+{
+    ipp_attribute_t *attr;
+    const gchar *name = queue_name_from_request (request);
+    BenchQueue *q = name ? g_hash_table_lookup (queues, name) : NULL;
+    ipp_status_t status = IPP_OK;
+
+    pthread_mutex_lock (&mock_lock);
+    mock_requests++;
+
+    switch (request->request.op.operation_id) {
+    case CUPS_GET_PPDS:
+        mock_get_ppds (request, response);
+        break;
+    case CUPS_GET_PRINTERS:
+        g_hash_table_foreach (queues, add_queue_attrs, response);
+        break;
+    case CUPS_GET_DEVICES:
+        mock_get_devices (response);
+        break;
+    case CUPS_ADD_MODIFY_PRINTER:
+        attr = ippFindAttribute (request, "device-uri", IPP_TAG_URI);
+        if (!name || !attr) {
+            status = IPP_BAD_REQUEST;
+        } else {
+            ipp_attribute_t *ppd = ippFindAttribute (request, "ppd-name", IPP_TAG_NAME);
+            const gchar *p = ppd ? strstr (ppd->values[0].string.text, "-model-") : NULL;
+            gchar *mm = p ? ppd_make_and_model (atoi (p + 7)) : g_strdup ("Local Raw Printer");
+
+            add_queue (name, attr->values[0].string.text, mm);
+            g_free (mm);
+        }
+        break;
+    case CUPS_DELETE_PRINTER:
+        if (q)
+            g_hash_table_remove (queues, name);
+        else
+            status = IPP_NOT_FOUND;
+        break;
+    case IPP_PAUSE_PRINTER:
+    case IPP_RESUME_PRINTER:
+        if (q)
+            q->state = request->request.op.operation_id == IPP_PAUSE_PRINTER ?
+                       IPP_PRINTER_STOPPED : IPP_PRINTER_IDLE;
+        else
+            status = IPP_NOT_FOUND;
+        break;
+    default:
+        status = IPP_OPERATION_NOT_SUPPORTED;
+        break;
+    }
+
+    pthread_mutex_unlock (&mock_lock);
+    return status;
+}
+
+static ssize_t buffer_read (void *data, ipp_uchar_t *buf, size_t len)
+{
+    BenchBuffer *b = data;
+
+    len = MIN (len, b->len - b->pos);
+    memcpy (buf, b->data + b->pos, len);
+    b->pos += len;
+    return len;
+}
+
+static ssize_t string_write (void *data, ipp_uchar_t *buf, size_t len)
+{
+    g_string_append_len (data, (const gchar *) buf, len);
+    return len;
+}
+
+static gboolean write_all (gint fd, const gchar *data, gsize len)
+{
+    while (len > 0) {
+        gssize n = write (fd, data, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+
+        data += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Decode an IPP request body, handle it and write the HTTP response.
+ * The body is chunked, as cupsd sends it to HTTP/1.1 clients.
+ */
+static gboolean mock_respond (gint fd, const gchar *body, gsize len)
+{
+    BenchBuffer in = { body, len, 0 };
+    ipp_t *request = ippNew (), *response = ippNew ();
+    ipp_state_t state;
+    GString *out = g_string_new (NULL);
+    gchar *header;
+    gsize pos;
+    gboolean ret;
+
+    while ((state = ippReadIO (&in, buffer_read, 1, NULL, request)) != IPP_DATA &&
+           state != IPP_ERROR);
+
+    response->request.status.version[0] = 1;
+    response->request.status.version[1] = 1;
+    response->request.status.request_id = request->request.op.request_id;
+    ippAddString (response, IPP_TAG_OPERATION, IPP_TAG_CHARSET,
+                  "attributes-charset", NULL, "utf-8");
+    ippAddString (response, IPP_TAG_OPERATION, IPP_TAG_LANGUAGE,
+                  "attributes-natural-language", NULL, "en");
+
+    if (state == IPP_ERROR)
+        response->request.status.status_code = IPP_BAD_REQUEST;
+    else
+        response->request.status.status_code = mock_dispatch (request, response);
+
+    response->state = IPP_IDLE;
+    while ((state = ippWriteIO (out, string_write, 1, NULL, response)) != IPP_DATA &&
+           state != IPP_ERROR);
+
+    header = g_strdup ("HTTP/1.1 200 OK\r\n"
+                       "Content-Type: application/ipp\r\n"
+                       "Transfer-Encoding: chunked\r\n\r\n");
+    ret = write_all (fd, header, strlen (header));
+    g_free (header);
+
+    for (pos = 0; ret && pos < out->len; pos += MOCK_CHUNK_SIZE) {
+        gsize size = MIN (MOCK_CHUNK_SIZE, out->len - pos);
+
+        header = g_strdup_printf ("%x\r\n", (guint) size);
+        ret = write_all (fd, header, strlen (header)) &&
+              write_all (fd, out->str + pos, size) && write_all (fd, "\r\n", 2);
+        g_free (header);
+    }
+
+    if (ret)
+        ret = write_all (fd, "0\r\n\r\n", 5);
+
+    g_string_free (out, TRUE);
+    ippDelete (request);
+    ippDelete (response);
+    return ret;
+}
+
+/*
+ * Find a header in a block of HTTP headers.  Returns a pointer to
+ * its value, or NULL.
+ */
+static const gchar *find_header (const gchar *headers, const gchar *name)
+{
+    gsize len = strlen (name);
+    const gchar *p;
+
+    for (p = strstr (headers, "\r\n"); p; p = strstr (p, "\r\n")) {
+        p += 2;
+        if (!g_ascii_strncasecmp (p, name, len) && p[len] == ':') {
+            p += len + 1;
+            while (*p == ' ')
+                p++;
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Remove a chunked body from the start of buf into body.  Returns the
+ * number of bytes it took up, or 0 if it isn't all there yet.
+ */
+static gsize dechunk (const gchar *buf, gsize len, GString *body)
+{
+    gsize pos = 0;
+
+    for (;;) {
+        const gchar *eol = g_strstr_len (buf + pos, len - pos, "\r\n");
+        gsize size;
+
+        if (!eol)
+            return 0;
+
+        size = strtoul (buf + pos, NULL, 16);
+        pos = eol + 2 - buf;
+        if (!size)
+            return pos + 2 <= len ? pos + 2 : 0;
+
+        if (pos + size + 2 > len)
+            return 0;
+
+        g_string_append_len (body, buf + pos, size);
+        pos += size + 2;
+    }
+}
+
+/*
+ * Handle all the complete requests a client has sent.  Returns FALSE
+ * if the connection should be closed.
+ */
+static gboolean mock_handle_input (BenchClient *client)
+{
+    for (;;) {
+        GString *in = client->in, *body;
+        const gchar *end, *value;
+        gchar *headers;
+        gsize header_len, used;
+
+        end = g_strstr_len (in->str, in->len, "\r\n\r\n");
+        if (!end)
+            return TRUE;
+
+        header_len = end + 4 - in->str;
+        headers = g_strndup (in->str, header_len);
+
+        value = find_header (headers, "Expect");
+        if (value && !client->continued) {
+            const gchar *cont = "HTTP/1.1 100 Continue\r\n\r\n";
+            client->continued = TRUE;
+            if (!write_all (client->fd, cont, strlen (cont))) {
+                g_free (headers);
+                return FALSE;
+            }
+        }
+
+        body = g_string_new (NULL);
+        value = find_header (headers, "Transfer-Encoding");
+        if (value && !g_ascii_strncasecmp (value, "chunked", 7)) {
+            used = dechunk (in->str + header_len, in->len - header_len, body);
+            if (!used) {
+                g_string_free (body, TRUE);
+                g_free (headers);
+                return TRUE;
+            }
+        } else {
+            value = find_header (headers, "Content-Length");
+            used = value ? strtoul (value, NULL, 10) : 0;
+            if (in->len - header_len < used) {
+                g_string_free (body, TRUE);
+                g_free (headers);
+                return TRUE;
+            }
+
+            g_string_append_len (body, in->str + header_len, used);
+        }
+
+        g_free (headers);
+        g_string_erase (in, 0, header_len + used);
+        client->continued = FALSE;
+
+        if (!mock_respond (client->fd, body->str, body->len)) {
+            g_string_free (body, TRUE);
+            return FALSE;
+        }
+
+        g_string_free (body, TRUE);
+    }
+}
+
+/*
+ * The mock cupsd.  It takes any number of connections, since PPD
+ * lists are streamed on a connection of their own.
+ */
+static void *mock_cupsd (void *data)
+{
+    gint listener = GPOINTER_TO_INT (data);
+    GPtrArray *clients = g_ptr_array_new ();
+    gchar buf[8192];
+
+    for (;;) {
+        struct pollfd *fds = g_new (struct pollfd, clients->len + 1);
+        guint i;
+
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for (i = 0; i < clients->len; i++) {
+            fds[i + 1].fd = ((BenchClient *) g_ptr_array_index (clients, i))->fd;
+            fds[i + 1].events = POLLIN;
+        }
+
+        if (poll (fds, clients->len + 1, -1) < 0) {
+            g_free (fds);
+            continue;
+        }
+
+        for (i = clients->len; i > 0; i--) {
+            BenchClient *client = g_ptr_array_index (clients, i - 1);
+            gssize n;
+
+            if (!fds[i].revents)
+                continue;
+
+            n = read (client->fd, buf, sizeof (buf));
+            if (n > 0) {
+                g_string_append_len (client->in, buf, n);
+                if (mock_handle_input (client))
+                    continue;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            close (client->fd);
+            g_string_free (client->in, TRUE);
+            g_free (client);
+            g_ptr_array_remove_index (clients, i - 1);
+        }
+
+        if (fds[0].revents) {
+            gint fd = accept (listener, NULL, NULL);
+
+            if (fd >= 0) {
+                BenchClient *client = g_new0 (BenchClient, 1);
+                client->fd = fd;
+                client->in = g_string_new (NULL);
+                g_ptr_array_add (clients, client);
+            }
+        }
+
+        g_free (fds);
+    }
+
+    return NULL;
+}
+
+/*
+ * Start the mock cupsd on a free local port and point libcups at it.
+ */
+static gboolean start_mock_cupsd (void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof (addr);
+    pthread_t thread;
+    gint fd;
+
+    fd = socket (AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return FALSE;
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) ||
+        listen (fd, 16) ||
+        getsockname (fd, (struct sockaddr *) &addr, &len)) {
+        close (fd);
+        return FALSE;
+    }
+
+    if (pthread_create (&thread, NULL, mock_cupsd, GINT_TO_POINTER (fd))) {
+        close (fd);
+        return FALSE;
+    }
+
+    pthread_detach (thread);
+    cupsSetServer ("127.0.0.1");
+    cupsSetEncryption (HTTP_ENCRYPT_NEVER);
+    ippSetPort (ntohs (addr.sin_port));
+    return TRUE;
+}
+
+static gdouble now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles (const void *a, const void *b)
+{
+    gdouble x = *(const gdouble *) a, y = *(const gdouble *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static gdouble percentile (const gdouble *sorted, gint n, gint p)
+{
+    return sorted[MIN (n - 1, (n * p) / 100)];
+}
+
+/*
+ * Print the latency percentiles of a set of samples, in milliseconds.
+ */
+static void report (const gchar *what, gdouble *samples, gint n, gint requests)
+{
+    if (!n)
+        return;
+
+    qsort (samples, n, sizeof (gdouble), compare_doubles);
+    g_print ("%-10s n=%-5d p50=%8.2fms p90=%8.2fms p99=%8.2fms max=%8.2fms requests=%d\n",
+             what, n,
+             percentile (samples, n, 50) * 1000, percentile (samples, n, 90) * 1000,
+             percentile (samples, n, 99) * 1000, samples[n - 1] * 1000, requests);
+}
+
+/*
+ * Release what an event allocated, the way the daemon does at the end
+ * of a pass, keeping track of the most any event needed.
+ */
+static void end_event (void)
+{
+    arena_peak = MAX (arena_peak, arena.used);
+    free_detected_printers ();
+    arena_reset ();
+}
+
+/*
+ * Plug the printers in one at a time and time how long it takes
+ * until each has a queue.  what says whether they're new or are
+ * being plugged in again.
+ */
+static void bench_add (gint events, const gchar *what)
+{
+    gdouble *samples = g_new (gdouble, events);
+    gint i, requests = mock_requests;
+
+    for (i = 0; i < events; i++) {
+        const gchar *udi = fleet[i].udi;
+        gdouble start;
+
+        set_attached (&fleet[i], TRUE);
+
+        start = now ();
+        invalidate_detected_printers ();
+        add_printers (&udi, 1, NULL);
+        samples[i] = now () - start;
+        end_event ();
+    }
+
+    report (what, samples, events, mock_requests - requests);
+    g_print ("%-10s %d queues\n", "", g_hash_table_size (queues));
+    g_free (samples);
+}
+
+/*
+ * Unplug the printers one at a time and time how long it takes until
+ * each queue is paused.
+ */
+static void bench_disable (gint events)
+{
+    gdouble *samples = g_new (gdouble, events);
+    gint i, requests = mock_requests;
+
+    for (i = 0; i < events; i++) {
+        gdouble start;
+
+        set_attached (&fleet[i], FALSE);
+
+        start = now ();
+        disable_printers (NULL);
+        samples[i] = now () - start;
+        end_event ();
+    }
+
+    report ("disable", samples, events, mock_requests - requests);
+    g_free (samples);
+}
+
+/*
+ * Start from a queue on the hal backend for every printer, with all
+ * of them plugged in, and time one migration.
+ */
+static void bench_migrate (void)
+{
+    gdouble start, elapsed;
+    gint i, requests;
+
+    g_hash_table_remove_all (queues);
+    for (i = 0; i < n_fleet; i++) {
+        gchar *name = g_strdup_printf ("hal_%d", i);
+        gchar *uri = g_strconcat ("hal://", fleet[i].udi, NULL);
+        gchar *mm = ppd_make_and_model (i);
+
+        add_queue (name, uri, mm);
+        fleet[i].attached = TRUE;
+        g_free (name);
+        g_free (uri);
+        g_free (mm);
+    }
+
+    if (use_backends)
+        write_usb_devices ();
+
+    requests = mock_requests;
+    start = now ();
+    invalidate_detected_printers ();
+    migrate_hal_printers ();
+    elapsed = now () - start;
+    end_event ();
+
+    report ("migrate", &elapsed, 1, mock_requests - requests);
+    g_print ("%-10s %.2fms per queue\n", "", elapsed * 1000 / n_fleet);
+}
+
+/*
+ * Start with no queues and all the printers plugged in, as at boot,
+ * and time adding them all at once.
+ */
+static void bench_coldplug (void)
+{
+    gdouble start, elapsed;
+    gint i, requests;
+
+    g_hash_table_remove_all (queues);
+    if (fingerprints) {
+        g_key_file_free (fingerprints);
+        fingerprints = NULL;
+    }
+    g_unlink (FINGERPRINTS_FILE);
+
+    for (i = 0; i < n_fleet; i++)
+        fleet[i].attached = TRUE;
+
+    if (use_backends)
+        write_usb_devices ();
+
+    requests = mock_requests;
+    start = now ();
+    invalidate_detected_printers ();
+    add_printers (NULL, 0, NULL);
+    elapsed = now () - start;
+    end_event ();
+
+    report ("coldplug", &elapsed, 1, mock_requests - requests);
+    g_print ("%-10s %d queues, %.2fms per queue\n", "", g_hash_table_size (queues),
+             elapsed * 1000 / n_fleet);
+}
+
+int main (int argc, char *argv[])
+{
+    GOptionContext *ctx;
+    GError *err = NULL;
+    gint printers = 100, ppds = 5000, events = 0;
+    gboolean no_index = FALSE, verbose = FALSE;
+    gchar *scenario = NULL;
+    struct rusage usage;
+    gdouble start;
+
+    GOptionEntry entries[] = {
+        { "printers", 'n', 0, G_OPTION_ARG_INT, &printers, "Number of printers in the fleet (1-1000)", "N" },
+        { "ppds", 'p', 0, G_OPTION_ARG_INT, &ppds, "Number of PPDs cupsd has (1000-50000)", "N" },
+        { "events", 'e', 0, G_OPTION_ARG_INT, &events, "Number of hotplug events to time", "N" },
+        { "scenario", 's', 0, G_OPTION_ARG_STRING, &scenario, "add, disable, replug, migrate, coldplug or all", "NAME" },
+        { "backends", 'b', 0, G_OPTION_ARG_NONE, &use_backends,
+          "Run the scripted backends instead of asking cupsd for devices", NULL },
+        { "no-index", 0, 0, G_OPTION_ARG_NONE, &no_index, "Don't use the PPD index", NULL },
+        { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Show the cups-autoconfig log", NULL },
+        { NULL, 0, 0, 0, NULL, NULL, NULL }
+    };
+
+    ctx = g_option_context_new ("- time cups-autoconfig against a mock cupsd and HAL");
+    g_option_context_add_main_entries (ctx, entries, NULL);
+    if (!g_option_context_parse (ctx, &argc, &argv, &err)) {
+        g_printerr ("%s\n", err->message);
+        g_error_free (err);
+        return 1;
+    }
+    g_option_context_free (ctx);
+
+    printers = CLAMP (printers, 1, 1000);
+    n_ppds = CLAMP (ppds, 1000, 50000);
+    events = events > 0 ? MIN (events, printers) : printers;
+    if (!scenario)
+        scenario = g_strdup ("all");
+
+    if (strcmp (scenario, "add") && strcmp (scenario, "disable") && strcmp (scenario, "replug") &&
+        strcmp (scenario, "migrate") && strcmp (scenario, "coldplug") && strcmp (scenario, "all")) {
+        g_printerr ("Unknown scenario '%s'\n", scenario);
+        return 1;
+    }
+
+    /* log_it() writes to stderr too, and there's no log file */
+    if (verbose)
+        log_level = LOG_LEVEL_DEBUG;
+    else
+        freopen ("/dev/null", "w", stderr);
+
+    config = g_new0 (ConfigInfo, 1);
+    config->add = TRUE;
+    config->remove = TRUE;
+    config->cups_devices = !use_backends;
+    config->device_timeout = DEFAULT_DEVICE_TIMEOUT;
+    config->detected_ttl = 0;
+    load_vendor_mappings ();
+
+    queues = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, free_queue);
+    make_fleet (printers);
+    write_backends ();
+
+    /* PPD lists are read until a good enough one turns up, then dropped */
+    signal (SIGPIPE, SIG_IGN);
+
+    if (!start_mock_cupsd () || !cups_connect ()) {
+        g_printerr ("Failed to start the mock cupsd\n");
+        return 1;
+    }
+
+    hal_ctx = libhal_ctx_new ();
+
+    /* the index is checked against the cups PPD cache, so fake one */
+    g_mkdir_with_parents (LOCALSTATEDIR "/cache/cups", 0755);
+    g_unlink (PPD_INDEX_FILE);
+    g_unlink (FINGERPRINTS_FILE);
+    if (no_index) {
+        g_unlink (CUPS_PPD_CACHE);
+    } else {
+        gchar *stamp = g_strdup_printf ("%d %d\n", n_ppds, (gint) time (NULL));
+        g_file_set_contents (CUPS_PPD_CACHE, stamp, -1, NULL);
+        g_free (stamp);
+
+        start = now ();
+        get_ppd_index ();
+        g_print ("%-10s %.2fms for %d PPDs\n", "index", (now () - start) * 1000, n_ppds);
+    }
+
+    g_print ("%d printers, %d PPDs, %s\n", printers, n_ppds,
+             use_backends ? "scripted backends" : "CUPS-Get-Devices");
+
+    if (strcmp (scenario, "migrate") && strcmp (scenario, "coldplug"))
+        bench_add (events, "add");
+
+    if (strcmp (scenario, "add") && strcmp (scenario, "migrate") && strcmp (scenario, "coldplug"))
+        bench_disable (events);
+
+    if (!strcmp (scenario, "replug") || !strcmp (scenario, "all"))
+        bench_add (events, "replug");
+
+    if (!strcmp (scenario, "migrate") || !strcmp (scenario, "all"))
+        bench_migrate ();
+
+    if (!strcmp (scenario, "coldplug") || !strcmp (scenario, "all"))
+        bench_coldplug ();
+
+    getrusage (RUSAGE_SELF, &usage);
+    g_print ("%-10s peak rss %ldkB, at most %lu bytes of printer records per event\n",
+             "memory", usage.ru_maxrss, (gulong) arena_peak);
+
+    ppd_index_close ();
+    cups_disconnect ();
+    return 0;
+}
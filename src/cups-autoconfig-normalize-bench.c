@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2007 Novell, Inc. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, contact Novell, Inc.
+ *
+ * To contact Novell about this file by physical or electronic mail,
+ * you may find current contact information at www.novell.com.
+ *
+ */
+
+/*
+ * Make and model normalization benchmark.  model_from_string() is run
+ * over a corpus of PPD make and model strings and compared with the
+ * strstr() version it replaced, both for speed and for its results.
+ */
+
+#define main cups_autoconfig_main
+int main (int argc, char *argv[]);
+#include "cups-autoconfig.c"
+#undef main
+
+#define DEFAULT_ROUNDS 200
+
+typedef struct _CorpusLine {
+    gchar *make;
+    gchar *make_and_model;
+    gchar *expected;
+} CorpusLine;
+
+/*
+ * The strstr() version of model_from_string(), with the aliases
+ * upper-cased so that they can match.
+ */
+static gchar *reference_model_from_string (const gchar *make_str, const gchar *model_str)
+{
+    gchar *make, *ss = NULL, *mdl = NULL;
+    gsize ss_len;
+    int i;
+
+    mdl = g_ascii_strup (model_str, -1);
+    make = g_strstrip (g_ascii_strup (make_str, -1));
+
+    for (i = 0; model_noise[i]; i++) {
+        ss = strstr (mdl, model_noise[i]);
+        if (ss)
+            *ss = '\0';
+    }
+
+    mdl = g_strstrip (mdl);
+
+    ss_len = strlen (make);
+    ss = strstr (mdl, make);
+    if (!ss) {
+        const gchar * const *alias = g_hash_table_lookup (alias_map, make);
+        if (!alias)
+            goto done;
+
+        for (; *alias; alias++) {
+            gchar *ua = g_ascii_strup (*alias, -1);
+
+            ss = strstr (mdl, ua);
+            g_free (ua);
+            if (ss) {
+                ss_len = strlen (*alias);
+                break;
+            }
+        }
+    }
+
+    if (ss) {
+        gchar *p = ss + ss_len;
+        gchar *tmp = mdl;
+        mdl = g_strdup (p);
+        g_free (tmp);
+    }
+
+    mdl = g_strstrip (mdl);
+
+done:
+    g_free (make);
+    return mdl;
+}
+
+static GArray *load_corpus (const gchar *path)
+{
+    GArray *corpus;
+    GError *err = NULL;
+    gchar *contents, **lines;
+    gint i;
+
+    if (!g_file_get_contents (path, &contents, NULL, &err)) {
+        g_printerr ("Failed to read '%s': %s\n", path, err->message);
+        g_error_free (err);
+        return NULL;
+    }
+
+    corpus = g_array_new (FALSE, FALSE, sizeof (CorpusLine));
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        gchar **fields = g_strsplit (lines[i], "\t", 3);
+        CorpusLine line;
+
+        if (lines[i][0] == '#' || !fields[0] || !fields[1]) {
+            g_strfreev (fields);
+            continue;
+        }
+
+        line.make = g_strdup (fields[0]);
+        line.make_and_model = g_strdup (fields[1]);
+        line.expected = g_strdup (fields[2]);
+        g_array_append_val (corpus, line);
+        g_strfreev (fields);
+    }
+
+    g_strfreev (lines);
+    g_free (contents);
+    return corpus;
+}
+
+static gdouble now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run a normalizer over the corpus rounds times and return the
+ * average time per string in nanoseconds.
+ */
+static gdouble time_normalizer (gchar *(*normalize) (const gchar *, const gchar *),
+                                GArray *corpus, gint rounds)
+{
+    gdouble start = now ();
+    gint r;
+    guint i;
+
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < corpus->len; i++) {
+            CorpusLine *line = &g_array_index (corpus, CorpusLine, i);
+            g_free (normalize (line->make, line->make_and_model));
+        }
+    }
+
+    return (now () - start) * 1e9 / ((gdouble) rounds * corpus->len);
+}
+
+int main (int argc, char *argv[])
+{
+    GArray *corpus;
+    gint rounds = argc > 2 ? atoi (argv[2]) : DEFAULT_ROUNDS;
+    gint differ = 0;
+    gdouble ref, fast;
+    guint i;
+
+    if (argc < 2) {
+        g_printerr ("usage: %s CORPUS [ROUNDS]\n", argv[0]);
+        return 1;
+    }
+
+    corpus = load_corpus (argv[1]);
+    if (!corpus)
+        return 1;
+
+    log_level = LOG_LEVEL_ERROR;
+    load_vendor_mappings ();
+
+    for (i = 0; i < corpus->len; i++) {
+        CorpusLine *line = &g_array_index (corpus, CorpusLine, i);
+        gchar *a = reference_model_from_string (line->make, line->make_and_model);
+        gchar *b = model_from_string (line->make, line->make_and_model);
+
+        if (strcmp (a, b)) {
+            g_print ("differs: '%s' '%s': '%s' vs '%s'\n", line->make, line->make_and_model, a, b);
+            differ++;
+        } else if (line->expected && strcmp (b, line->expected)) {
+            g_print ("unexpected: '%s' '%s': '%s', not '%s'\n", line->make,
+                     line->make_and_model, b, line->expected);
+            differ++;
+        }
+
+        g_free (a);
+        g_free (b);
+    }
+
+    ref = time_normalizer (reference_model_from_string, corpus, MAX (rounds, 1));
+    fast = time_normalizer (model_from_string, corpus, MAX (rounds, 1));
+
+    g_print ("%u strings, %d differ\n", corpus->len, differ);
+    g_print ("strstr:       %8.1f ns/string\n", ref);
+    g_print ("aho-corasick: %8.1f ns/string (%.1fx)\n", fast, ref / fast);
+
+    return differ ? 1 : 0;
+}
@@ -24,10 +24,15 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <ctype.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sys/resource.h>
 
 #include <config.h>
 
@@ -46,6 +51,89 @@
 #define LOGFILE LOCALSTATEDIR "/log/cups-autoconfig.log"
 #define CONFIGFILE SYSCONFDIR "/cups-autoconfig.conf"
 #define MAX_LOG_SIZE 20971520
+#define LOG_BUFFER_SIZE 65536
+#define LOG_FLUSH_INTERVAL 1
+#define TRACE_MAX_EVENTS 100000
+#define DEVICE_ID_TIMEOUT 3
+#define ARENA_BLOCK_SIZE 16384
+#define ARENA_ALIGN 8
+#define PPD_STREAM_BUFFER 32768
+
+#define log_error(...) log_msg (LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_it(...) log_msg (LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) G_STMT_START { \
+    if (log_level >= LOG_LEVEL_DEBUG) \
+        log_msg (LOG_LEVEL_DEBUG, __VA_ARGS__); \
+} G_STMT_END
+
+#define trace_add(counter, n) (trace_counters[counter] += (n))
+
+#define CUPS_PPD_CACHE LOCALSTATEDIR "/cache/cups/ppds.dat"
+#define CACHE_DIR LOCALSTATEDIR "/cache/cups-autoconfig"
+#define PPD_INDEX_FILE CACHE_DIR "/ppd.index"
+#define PPD_INDEX_MAGIC 0x43415049 /* CAPI */
+#define PPD_INDEX_VERSION 3
+#define PPD_INDEX_NO_STRING G_MAXUINT32
+#define PPD_INDEX_MAX_CANDIDATES 16
+#define DETECTED_FILE CACHE_DIR "/detected"
+#define FINGERPRINTS_FILE CACHE_DIR "/fingerprints"
+#define DEFAULT_DETECTED_TTL 10
+#define DEFAULT_DEVICE_TIMEOUT 5
+#define BACKEND_KILL_TIMEOUT 1000
+#define BACKEND_REAP_INTERVAL 10
+
+#define PID_FILE LOCALSTATEDIR "/run/cups-autoconfig.pid"
+#define DAEMON_DISPATCH_TIMEOUT 1000
+#define DEFAULT_COALESCE_WINDOW 250
+#define DEFAULT_FLAP_THRESHOLD 3
+#define DEFAULT_FLAP_HOLD_TIME 30
+#define MATCHER_MAX_NAMES 8
+
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+} LogLevel;
+
+typedef enum {
+    TRACE_IPP_REQUESTS,
+    TRACE_BYTES_RECEIVED,
+    TRACE_BACKEND_SPAWNS,
+    TRACE_HAL_CALLS,
+    TRACE_PPDS_SCANNED,
+    TRACE_ARENA_ALLOCS,
+    TRACE_ARENA_BYTES,
+    TRACE_N_COUNTERS
+} TraceCounter;
+
+/*
+ * A phase being timed for --trace, and what the counters were when
+ * it started.
+ */
+typedef struct _TraceSpan {
+    gint64 start;
+    gint64 counters[TRACE_N_COUNTERS];
+} TraceSpan;
+
+/*
+ * Where the printer records and their strings for one run, or one
+ * daemon pass, come from.  Nothing is freed on its own, it all goes
+ * in arena_reset().
+ */
+typedef struct _Arena {
+    GSList *blocks;
+    gchar *next;
+    gsize left;
+    GStringChunk *strings;
+    gsize used;
+} Arena;
+
+typedef struct _TraceEvent {
+    const gchar *name;
+    gint64 start;
+    gint64 duration;
+    gint64 counters[TRACE_N_COUNTERS];
+} TraceEvent;
 
 typedef enum {
     PPD_NO_MATCH,
@@ -54,6 +142,40 @@ typedef enum {
     PPD_MANUFACTURER
 } PPDScore;
 
+/*
+ * A field of an IEEE 1284 device id.  It points into the id string
+ * and isn't NUL terminated.
+ */
+typedef struct _IdField {
+    const gchar *str;
+    gsize len;
+} IdField;
+
+typedef struct _DeviceId {
+    IdField mfg;
+    IdField mdl;
+    IdField sn;
+    IdField des;
+    IdField cmd;
+} DeviceId;
+
+/*
+ * A line of backend output, split into its fields:
+ *
+ *   class uri "make-and-model" "info" ["device-id" ["location"]]
+ *
+ * The fields point into the line, which isn't changed, so the quoted
+ * ones still have their backslash escapes.  Missing fields are empty.
+ */
+typedef struct _BackendDevice {
+    IdField dclass;
+    IdField uri;
+    IdField make_and_model;
+    IdField info;
+    IdField device_id;
+    IdField location;
+} BackendDevice;
+
 typedef struct _PrinterInfo {
     gchar *uri;
     gchar *name;
@@ -64,32 +186,521 @@ typedef struct _PrinterInfo {
     gchar *serial;
     gchar *description;
     gchar *alt_description;
+    gint state;
+    DeviceId id;
 } PrinterInfo;
 
 typedef struct _ConfigInfo {
     gchar *default_policy;
     gboolean add;
     gboolean remove;
+    gint detected_ttl;
+    gboolean cups_devices;
+    gint device_timeout;
+    gint coalesce_window;
+    gint flap_threshold;
+    gint flap_hold_time;
 } ConfigInfo;
 
-static FILE *log_file;
+/*
+ * IPP requests that are sent together, and the status cupsd answered
+ * each one with.
+ */
+typedef struct _IppBatch {
+    GPtrArray *requests;
+    GArray *status;
+} IppBatch;
+
+typedef enum {
+    HOTPLUG_ADD,
+    HOTPLUG_REMOVE
+} HotplugType;
+
+/*
+ * A printer event queued by the daemon.
+ */
+typedef struct _HotplugEvent {
+    HotplugType type;
+    gchar *udi;
+    time_t time;
+} HotplugEvent;
+
+/*
+ * What the daemon knows about a HAL printer.  applied is the presence
+ * we last acted on, so a device needs handling when it differs from
+ * present.  A device that changes state flap_threshold times within
+ * flap_hold_time seconds is held until it has settled down.
+ */
+typedef struct _DeviceState {
+    gboolean present;
+    gboolean applied;
+    gboolean held;
+    guint changes;
+    time_t first_change;
+    time_t last_change;
+    gchar *uri;
+} DeviceState;
+
+/*
+ * The IEEE 1284 id read from a device node.  A printer that's plugged
+ * in again gets a new node, so the id is read again when the device
+ * number or the node's ctime change.  id is NULL if the read failed.
+ */
+typedef struct _CachedDeviceId {
+    dev_t rdev;
+    time_t ctime;
+    gchar *id;
+} CachedDeviceId;
+
+/*
+ * On-disk layout of the PPD match index.  All offsets are relative to the
+ * start of the file and all string offsets are relative to the string table.
+ */
+typedef struct _PPDIndexHeader {
+    guint32 magic;
+    guint32 version;
+    gint64 cache_mtime;
+    gint64 cache_size;
+    guint32 n_entries;
+    guint32 n_keys;
+    guint32 n_buckets;
+    guint32 n_postings;
+    guint32 entries_offset;
+    guint32 keys_offset;
+    guint32 buckets_offset;
+    guint32 postings_offset;
+    guint32 strings_offset;
+    guint32 strings_size;
+} PPDIndexHeader;
+
+typedef struct _PPDIndexEntry {
+    guint32 name;
+    guint32 make_and_model;
+    guint32 id_model;
+    guint32 model;
+    guint32 score;
+} PPDIndexEntry;
+
+typedef struct _PPDIndexKey {
+    guint32 hash;
+    guint32 key;
+    guint32 first;
+    guint32 count;
+} PPDIndexKey;
+
+typedef struct _PPDIndex {
+    GMappedFile *file;
+    const PPDIndexHeader *header;
+    const PPDIndexEntry *entries;
+    const PPDIndexKey *keys;
+    const guint32 *buckets;
+    const guint32 *postings;
+    const gchar *strings;
+} PPDIndex;
+
+/*
+ * An Aho-Corasick automaton over the noise that ends the model in a
+ * make and model string, and the names of one make.  Bytes are mapped
+ * to classes first, letters case-insensitively, so the transition
+ * table only has a column for each byte the patterns use.
+ */
+typedef struct _ModelMatcher {
+    guint8 classes[256];
+    guint n_classes;
+    guint n_states;
+    guint16 *next;
+    guint32 *noise;
+    guint32 *names;
+    guint n_names;
+} ModelMatcher;
+
+/*
+ * Noise in make and model strings.  Each is cut off the model in
+ * turn, where it first starts in what is left of the model.
+ */
+static const gchar * const model_noise[] = {
+    ",", "(", "FOOMATIC/", "- CUPS", "CUPS", "(RECOMMEND",
+    " POSTSCRIPT ", " PS3 ", " PS -", " PS V", "W/PS", NULL
+};
+
+/*
+ * Other names a make goes by in make and model strings.  The first
+ * column is the make as we normalize it.  They match whatever their
+ * case, like the make does.
+ */
+static const gchar * const make_aliases[][MATCHER_MAX_NAMES] = {
+    { "OKIDATA", "OKI DATA CORP", "OKI", NULL },
+    { "MINOLTA", "MINOLTA-QMS", "MINOLTA QMS", "KONICA MINOLTA", NULL },
+    { "LEXMARK", "Lexmark-International", "Lexmark International", NULL },
+    { "KYOCERA", "Kyocera-Mita", "Kyocera Mita", NULL },
+    { "HP", "Hewlett-Packard", "Hewlett Packard", NULL },
+    { "DYMO", "Dymo-CoStar", NULL },
+    { "CANON", "Canon Inc. (Kosugi Offic", NULL },
+    { "GENERIC", "Raw Queue", "Postscript", NULL }
+};
+
+static LogLevel log_level = LOG_LEVEL_INFO;
+static gint log_fd = -1;
+static GString *log_buffer;
+static GMutex *log_lock;
+static GCond *log_cond;
+static GThread *log_thread;
+static gboolean log_flush_now;
+static gboolean log_quit;
+static const gchar * const trace_counter_names[TRACE_N_COUNTERS] = {
+    "ipp_requests", "bytes_received", "backend_spawns", "hal_calls", "ppds_scanned",
+    "arena_allocs", "arena_bytes"
+};
+static gint64 trace_counters[TRACE_N_COUNTERS];
+static GArray *trace_events;
+static guint trace_dropped;
+static Arena arena;
 static ConfigInfo *config;
 static GHashTable *alias_map;
 static GHashTable *vendor_map;
+static GHashTable *model_matchers;
 static http_t *global_cups_connection;
 static LibHalContext *hal_ctx;
+static GHashTable *hal_properties;
+static PPDIndex *ppd_index;
+static gboolean ppd_index_tried;
+static gint ppd_index_tried_errno;
+static struct stat ppd_index_tried_cache;
+static GSList *detected_printers;
+static gboolean have_detected_printers;
+static GHashTable *detected_by_serial;
+static GHashTable *detected_by_model;
+static GHashTable *device_ids;
+static GArray *stray_children;
+static GKeyFile *fingerprints;
+static gboolean fingerprints_changed;
+static GQueue *hotplug_events;
+static GHashTable *hal_printers;
+static volatile sig_atomic_t daemon_quit;
+
+/*
+ * Append to the log.  If another process has rotated the log since we
+ * opened it, or it has grown too big, move on to a new file first.
+ * Every process appends with O_APPEND and only one of them renames the
+ * file, under an flock() on the old one, so no lines are lost.
+ */
+static void log_write (const gchar *data, gsize len)
+{
+    struct stat info, current;
+
+    if (!fstat (log_fd, &info) && info.st_size + len > MAX_LOG_SIZE &&
+        !flock (log_fd, LOCK_EX)) {
+        gint fd;
+
+        if (!stat (LOGFILE, &current) && current.st_ino == info.st_ino &&
+            current.st_dev == info.st_dev)
+            rename (LOGFILE, LOGFILE ".1");
+
+        fd = open (LOGFILE, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        flock (log_fd, LOCK_UN);
+        if (fd >= 0) {
+            close (log_fd);
+            log_fd = fd;
+        }
+    }
+
+    while (len > 0) {
+        gssize n = write (log_fd, data, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+
+        data += n;
+        len -= n;
+    }
+}
+
+/*
+ * Write the log buffer out once a second, or sooner when it fills up
+ * or an error is logged.  The buffers are swapped under the lock so
+ * the writes don't hold up the code that's logging.
+ */
+static gpointer log_writer (gpointer data)
+{
+    GString *out = g_string_sized_new (LOG_BUFFER_SIZE);
+    gboolean quit;
+
+    g_mutex_lock (log_lock);
+    for (;;) {
+        GString *tmp;
 
-static void log_it (const char *fmt, ...)
+        if (!log_flush_now && !log_quit) {
+            GTimeVal until;
+
+            g_get_current_time (&until);
+            g_time_val_add (&until, LOG_FLUSH_INTERVAL * G_USEC_PER_SEC);
+            g_cond_timed_wait (log_cond, log_lock, &until);
+        }
+
+        tmp = log_buffer;
+        log_buffer = out;
+        out = tmp;
+        log_flush_now = FALSE;
+        quit = log_quit;
+        g_mutex_unlock (log_lock);
+
+        if (out->len)
+            log_write (out->str, out->len);
+        g_string_truncate (out, 0);
+
+        if (quit)
+            break;
+
+        g_mutex_lock (log_lock);
+    }
+
+    g_string_free (out, TRUE);
+    return NULL;
+}
+
+/*
+ * Format a message once and send it to stderr and the log buffer.
+ * Use the log_error(), log_it() and log_debug() macros rather than
+ * calling this directly.
+ */
+static void log_msg (LogLevel level, const char *fmt, ...)
 {
     va_list args;
-    
-    va_start (args, fmt);
-    g_vfprintf (log_file, fmt, args);
-    va_end (args);
+    gchar *msg;
+
+    if (level > log_level)
+        return;
 
     va_start (args, fmt);
-    g_vfprintf (stderr, fmt, args);
+    msg = g_strdup_vprintf (fmt, args);
     va_end (args);
+
+    fputs (msg, stderr);
+
+    if (log_buffer) {
+        g_mutex_lock (log_lock);
+        g_string_append (log_buffer, msg);
+        if (level == LOG_LEVEL_ERROR || log_buffer->len >= LOG_BUFFER_SIZE) {
+            if (log_thread) {
+                log_flush_now = TRUE;
+                g_cond_signal (log_cond);
+            } else {
+                log_write (log_buffer->str, log_buffer->len);
+                g_string_truncate (log_buffer, 0);
+            }
+        }
+        g_mutex_unlock (log_lock);
+    }
+
+    g_free (msg);
+}
+
+static gint64 get_time_us (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/*
+ * Start timing a phase.  This does nothing unless --trace was given.
+ */
+static void trace_begin (TraceSpan *span)
+{
+    if (!trace_events)
+        return;
+
+    span->start = get_time_us ();
+    memcpy (span->counters, trace_counters, sizeof (trace_counters));
+}
+
+/*
+ * Record a phase, with how much each counter went up during it.
+ */
+static void trace_end (TraceSpan *span, const gchar *name)
+{
+    TraceEvent ev;
+    gint i;
+
+    if (!trace_events)
+        return;
+
+    if (trace_events->len >= TRACE_MAX_EVENTS) {
+        trace_dropped++;
+        return;
+    }
+
+    ev.name = name;
+    ev.start = span->start;
+    ev.duration = get_time_us () - span->start;
+    for (i = 0; i < TRACE_N_COUNTERS; i++)
+        ev.counters[i] = trace_counters[i] - span->counters[i];
+
+    g_array_append_val (trace_events, ev);
+}
+
+static void trace_write_counters (FILE *f, const gint64 *counters, gboolean all)
+{
+    gboolean first = TRUE;
+    gint i;
+
+    for (i = 0; i < TRACE_N_COUNTERS; i++) {
+        if (!all && !counters[i])
+            continue;
+
+        fprintf (f, "%s\"%s\":%" G_GINT64_FORMAT, first ? "" : ",",
+                 trace_counter_names[i], counters[i]);
+        first = FALSE;
+    }
+}
+
+/*
+ * Write the phases out in the Chrome trace event format, which
+ * chrome://tracing and Perfetto can load.  The totals and peak RSS
+ * go in otherData.
+ */
+static void trace_write (const gchar *path)
+{
+    struct rusage self, children;
+    FILE *f;
+    pid_t pid = getpid ();
+    guint i;
+
+    f = fopen (path, "w");
+    if (!f) {
+        log_error ("Failed to write trace '%s': %s\n", path, strerror (errno));
+        return;
+    }
+
+    getrusage (RUSAGE_SELF, &self);
+    getrusage (RUSAGE_CHILDREN, &children);
+
+    fprintf (f, "{\"traceEvents\":[\n");
+    for (i = 0; i < trace_events->len; i++) {
+        TraceEvent *ev = &g_array_index (trace_events, TraceEvent, i);
+
+        fprintf (f, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT
+                 ",\"dur\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":1,\"args\":{",
+                 ev->name, ev->start, ev->duration, (int) pid);
+        trace_write_counters (f, ev->counters, FALSE);
+        fprintf (f, "}},\n");
+    }
+
+    fprintf (f, "{\"name\":\"totals\",\"ph\":\"C\",\"ts\":%" G_GINT64_FORMAT
+             ",\"pid\":%d,\"tid\":1,\"args\":{", get_time_us (), (int) pid);
+    trace_write_counters (f, trace_counters, TRUE);
+    fprintf (f, "}}\n],\n\"otherData\":{");
+    trace_write_counters (f, trace_counters, TRUE);
+    fprintf (f, ",\"peak_rss_kb\":%ld,\"backend_peak_rss_kb\":%ld,\"dropped_events\":%u}}\n",
+             self.ru_maxrss, children.ru_maxrss, trace_dropped);
+
+    if (fclose (f))
+        log_error ("Failed to write trace '%s': %s\n", path, strerror (errno));
+}
+
+/*
+ * The resident set size in kB, or 0 if it can't be read.
+ */
+static gulong get_rss (void)
+{
+    gchar *contents = NULL;
+    gulong size, resident = 0;
+
+    if (g_file_get_contents ("/proc/self/statm", &contents, NULL, NULL) &&
+        sscanf (contents, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+
+    g_free (contents);
+    return resident * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * Allocate zeroed memory from the arena.
+ */
+static gpointer arena_alloc0 (gsize size)
+{
+    gpointer ret;
+
+    size = (size + ARENA_ALIGN - 1) & ~(gsize) (ARENA_ALIGN - 1);
+    if (size > arena.left) {
+        gsize block = MAX (size, ARENA_BLOCK_SIZE);
+
+        arena.next = g_malloc (block);
+        arena.left = block;
+        arena.blocks = g_slist_prepend (arena.blocks, arena.next);
+    }
+
+    ret = arena.next;
+    arena.next += size;
+    arena.left -= size;
+    arena.used += size;
+    trace_add (TRACE_ARENA_ALLOCS, 1);
+    trace_add (TRACE_ARENA_BYTES, size);
+
+    memset (ret, 0, size);
+    return ret;
+}
+
+static gchar *arena_strndup (const gchar *str, gsize len)
+{
+    if (!str)
+        return NULL;
+
+    if (!arena.strings)
+        arena.strings = g_string_chunk_new (ARENA_BLOCK_SIZE);
+
+    arena.used += len + 1;
+    trace_add (TRACE_ARENA_ALLOCS, 1);
+    trace_add (TRACE_ARENA_BYTES, len + 1);
+    return g_string_chunk_insert_len (arena.strings, str, len);
+}
+
+static gchar *arena_strdup (const gchar *str)
+{
+    return str ? arena_strndup (str, strlen (str)) : NULL;
+}
+
+/*
+ * Like arena_strdup(), but there's only ever one copy of a string,
+ * which suits the makes and models the same printers keep turning up
+ * with.  The string mustn't be changed.
+ */
+static gchar *arena_intern (const gchar *str)
+{
+    if (!str)
+        return NULL;
+
+    if (!arena.strings)
+        arena.strings = g_string_chunk_new (ARENA_BLOCK_SIZE);
+
+    trace_add (TRACE_ARENA_ALLOCS, 1);
+    return g_string_chunk_insert_const (arena.strings, str);
+}
+
+/*
+ * Free everything allocated from the arena.  Nothing may point into
+ * it any more, i.e. the detected printers have to be freed first.
+ */
+static void arena_reset (void)
+{
+    g_slist_foreach (arena.blocks, (GFunc) g_free, NULL);
+    g_slist_free (arena.blocks);
+    if (arena.strings)
+        g_string_chunk_free (arena.strings);
+
+    memset (&arena, 0, sizeof (arena));
+}
+
+static gint get_int_value (GKeyFile *kf, const gchar *key, gint def)
+{
+    gchar *value = g_key_file_get_value (kf, "CUPS", key, NULL);
+    gint ret = value ? atoi (value) : def;
+
+    g_free (value);
+    return ret;
 }
 
 static gboolean load_config (void)
@@ -102,7 +713,7 @@ static gboolean load_config (void)
     config = g_malloc (sizeof (ConfigInfo));
 
     if (!g_key_file_load_from_file (kf, CONFIGFILE, G_KEY_FILE_NONE, &error)) {
-        log_it ("Error loading config file: %s\n", error->message);
+        log_error ("Error loading config file: %s\n", error->message);
         g_error_free (error);
         return FALSE;
     }
@@ -125,6 +736,25 @@ static gboolean load_config (void)
         config->default_policy = value;
     }
 
+    value = g_key_file_get_value (kf, "CUPS", "UseCUPSDevices", NULL);
+    config->cups_devices = !value || !strcmp (value, "yes") || !strcmp (value, "y") ? TRUE : FALSE;
+    g_free (value);
+
+    value = g_key_file_get_value (kf, "CUPS", "LogLevel", NULL);
+    if (value && !strcmp (value, "debug"))
+        log_level = LOG_LEVEL_DEBUG;
+    else if (value && !strcmp (value, "error"))
+        log_level = LOG_LEVEL_ERROR;
+    else
+        log_level = LOG_LEVEL_INFO;
+    g_free (value);
+
+    config->detected_ttl = get_int_value (kf, "DetectedPrintersTTL", DEFAULT_DETECTED_TTL);
+    config->device_timeout = get_int_value (kf, "DeviceTimeout", DEFAULT_DEVICE_TIMEOUT);
+    config->coalesce_window = get_int_value (kf, "EventCoalesceWindow", DEFAULT_COALESCE_WINDOW);
+    config->flap_threshold = get_int_value (kf, "FlapThreshold", DEFAULT_FLAP_THRESHOLD);
+    config->flap_hold_time = get_int_value (kf, "FlapHoldTime", DEFAULT_FLAP_HOLD_TIME);
+
     g_key_file_free (kf);
     return TRUE;
 }
@@ -136,52 +766,57 @@ static void free_config (void)
     config = NULL;
 }
 
-static void free_printer_info (gpointer data, gpointer user_data)
-{
-    PrinterInfo *pi = data;
-    g_free (pi->name);
-    g_free (pi->uri);
-    g_free (pi->make);
-    g_free (pi->model);
-    g_free (pi->make_and_model);
-    g_free (pi->device_id);
-    g_free (pi->serial);
-    g_free (pi->description);
-    g_free (pi->alt_description);
-}
-
 static gboolean open_log (void)
 {
-    struct stat info;
-    gboolean append = TRUE;
-
-    if (!stat (LOGFILE, &info) && info.st_size > MAX_LOG_SIZE)
-        append = FALSE;
-
-    log_file = fopen (LOGFILE, append ? "a" : "w");
-    if (!log_file) {
+    log_fd = open (LOGFILE, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (log_fd < 0) {
         g_printerr ("Failed to open log file: %s\n", strerror (errno));
         return FALSE;
     }
 
+    if (!g_thread_supported ())
+        g_thread_init (NULL);
+
+    log_buffer = g_string_sized_new (LOG_BUFFER_SIZE);
+    log_lock = g_mutex_new ();
+    log_cond = g_cond_new ();
+
+    /* without a writer thread the buffer is written out when it fills */
+    log_thread = g_thread_create (log_writer, NULL, TRUE, NULL);
     return TRUE;
 }
 
+static void close_log (void)
+{
+    if (!log_buffer)
+        return;
+
+    if (log_thread) {
+        g_mutex_lock (log_lock);
+        log_quit = TRUE;
+        g_cond_signal (log_cond);
+        g_mutex_unlock (log_lock);
+        g_thread_join (log_thread);
+        log_thread = NULL;
+    } else if (log_buffer->len) {
+        log_write (log_buffer->str, log_buffer->len);
+    }
+
+    g_string_free (log_buffer, TRUE);
+    log_buffer = NULL;
+    g_cond_free (log_cond);
+    g_mutex_free (log_lock);
+    close (log_fd);
+    log_fd = -1;
+}
+
 /*
  * Load our known vendor string mappings.
  */
 static void load_vendor_mappings (void)
 {
     gint i;
-    static char const *okidata[] = { "OKI DATA CORP", "OKI", NULL };
-    static char const *minolta[] = { "MINOLTA-QMS", "MINOLTA QMS", "KONICA MINOLTA", NULL };
-    static char const *lexmark[] = { "Lexmark-International", "Lexmark International", NULL };
-    static char const *kyocera[] = { "Kyocera-Mita", "Kyocera Mita", NULL };
-    static char const *hp[] = { "Hewlett-Packard", "Hewlett Packard", NULL };
-    static char const *dymo[] = { "Dymo-CoStar", NULL };
-    static char const *canon[] = { "Canon Inc. (Kosugi Offic", NULL };
-    static char const *generic[] = { "Raw Queue", "Postscript", NULL };
-    
+
     struct {
         const char *key;
         const char *val;
@@ -212,14 +847,13 @@ static void load_vendor_mappings (void)
     }
 
     alias_map = g_hash_table_new (g_str_hash, g_str_equal);
-    g_hash_table_insert (alias_map, "OKIDATA", okidata);
-    g_hash_table_insert (alias_map, "MINOLTA", minolta);
-    g_hash_table_insert (alias_map, "LEXMARK", lexmark);
-    g_hash_table_insert (alias_map, "KYOCERA", kyocera);
-    g_hash_table_insert (alias_map, "HP", hp);
-    g_hash_table_insert (alias_map, "DYMO", dymo);
-    g_hash_table_insert (alias_map, "CANON", canon);
-    g_hash_table_insert (alias_map, "GENERIC", generic);
+    for (i = 0; i < G_N_ELEMENTS (make_aliases); i++) {
+        g_hash_table_insert (alias_map,
+                             (gpointer) make_aliases[i][0],
+                             (gpointer) &make_aliases[i][1]);
+    }
+
+    model_matchers = g_hash_table_new (g_str_hash, g_str_equal);
 }
 
 /* 
@@ -229,7 +863,7 @@ static gboolean cups_connect (void)
 {
     global_cups_connection = httpConnectEncrypt (cupsServer (), ippPort (), cupsEncryption ());
     if (!global_cups_connection) {
-        log_it ("Failed to connect to cupsd\n");
+        log_error ("Failed to connect to cupsd\n");
         return FALSE;
     }
 
@@ -245,15 +879,89 @@ static void cups_disconnect (void)
         httpClose (global_cups_connection);
 }
 
+/*
+ * Get the string properties of a HAL device.  They're all fetched
+ * with one call the first time a device is asked about and kept until
+ * hal_forget_properties(), so matching a HAL printer against every
+ * detected printer doesn't go back to HAL each time.
+ */
+static GHashTable *hal_get_properties (const gchar *udi)
+{
+    LibHalPropertySet *set;
+    LibHalPropertySetIterator it;
+    GHashTable *props;
+
+    if (!hal_properties)
+        hal_properties = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify) g_hash_table_destroy);
+
+    props = g_hash_table_lookup (hal_properties, udi);
+    if (props)
+        return props;
+
+    props = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    trace_add (TRACE_HAL_CALLS, 1);
+    set = libhal_device_get_all_properties (hal_ctx, udi, NULL);
+    if (set) {
+        libhal_psi_init (&it, set);
+        for (; libhal_psi_has_more (&it); libhal_psi_next (&it)) {
+            if (libhal_psi_get_type (&it) == LIBHAL_PROPERTY_TYPE_STRING)
+                g_hash_table_insert (props, g_strdup (libhal_psi_get_key (&it)),
+                                     g_strdup (libhal_psi_get_string (&it)));
+        }
+        libhal_free_property_set (set);
+    } else
+        log_debug ("Failed to get the properties of '%s'\n", udi);
+
+    g_hash_table_insert (hal_properties, g_strdup (udi), props);
+    return props;
+}
+
+/*
+ * Forget the cached properties, e.g. because devices have come and
+ * gone since they were read.
+ */
+static void hal_forget_properties (void)
+{
+    if (hal_properties) {
+        g_hash_table_destroy (hal_properties);
+        hal_properties = NULL;
+    }
+}
+
+/*
+ * Read a string property of a HAL device.  The returned string needs
+ * to be freed with g_free().
+ */
+static gchar *hal_get_string (const gchar *udi, const gchar *key)
+{
+    return g_strdup (g_hash_table_lookup (hal_get_properties (udi), key));
+}
+
+/*
+ * Write a set of properties to a HAL device in one go.
+ */
+static gboolean hal_commit (LibHalChangeSet *cs)
+{
+    gboolean ret;
+
+    trace_add (TRACE_HAL_CALLS, 1);
+    ret = libhal_device_commit_changeset (hal_ctx, cs, NULL);
+    libhal_device_free_changeset (cs);
+    return ret;
+}
+
 /*
  * Set the printer.configured property on new printers for policy
  * applications like gvm.
  */
 static void set_printer_configured_existing_property (const gchar *udi, const gchar *name)
 {
-    if (!libhal_device_set_property_bool (hal_ctx, udi,
-                                          "printer.configured_existing", TRUE, NULL))
-        log_it ("Failed to set printer.configured_existing property for '%s'\n", udi);
+    LibHalChangeSet *cs = libhal_device_new_changeset (udi);
+
+    libhal_changeset_set_property_bool (cs, "printer.configured_existing", TRUE);
+    if (!hal_commit (cs))
+        log_error ("Failed to set printer.configured_existing property for '%s'\n", udi);
 }
 
 /*
@@ -262,53 +970,55 @@ static void set_printer_configured_existing_property (const gchar *udi, const gc
  */
 static void set_printer_configured_property (const gchar *udi, const gchar *name)
 {
-    if (!libhal_device_set_property_bool (hal_ctx, udi,
-                                          "printer.configured", TRUE, NULL))
-        log_it ("Failed to set printer.configured property for '%s'\n", udi);
+    LibHalChangeSet *cs = libhal_device_new_changeset (udi);
 
-    if (!libhal_device_set_property_string (hal_ctx, udi,
-                                            "printer.display_name", name, NULL))
-        log_it ("Failed to set printer.display_name\n");
+    libhal_changeset_set_property_bool (cs, "printer.configured", TRUE);
+    libhal_changeset_set_property_string (cs, "printer.display_name", name);
+    if (!hal_commit (cs))
+        log_error ("Failed to set printer.configured and printer.display_name for '%s'\n", udi);
 }
 
 /* 
  * Generate a unique name for a new printer.  The returned string 
- * needs to be freed by the caller. 
+ * is allocated from the arena.
  */
-static gchar *generate_printer_name (PrinterInfo *pi, GSList *curr)
+static gchar *generate_printer_name (PrinterInfo *pi, GHashTable *names)
 {
-    GSList *l = NULL;
-    gchar *ret = g_strdup (pi->make_and_model);
-    size_t len = strlen (ret);
+    gchar *base = g_strdup (pi->make_and_model), *name = NULL, *ret, *key;
+    size_t len = strlen (base);
     gboolean found;
     gint i;
 
     for (i = 0; i < len; i++) {
-        if (ret[i] == ' ' || ret[i] == '\\' || ret[i] == '#')
-            ret[i] = '_';
+        if (base[i] == ' ' || base[i] == '\\' || base[i] == '#')
+            base[i] = '_';
     }
 
     i = 0;
     do {
-        found = FALSE;
-        if (i++) {
-            gchar *tmp;
-            tmp = g_strdup_printf ("%s-%d", ret, i);
-            g_free (ret);
-            ret = tmp;
-        }
-
-        for (l = curr; l; l = l->next) {
-            PrinterInfo *p = l->data;
-            if (!g_ascii_strcasecmp (p->name, ret)) {
-                found = TRUE;
-                break;
-            }
-        }
+        g_free (name);
+        name = i++ ? g_strdup_printf ("%s-%d", base, i) : g_strdup (base);
+
+        key = g_ascii_strdown (name, -1);
+        found = g_hash_table_lookup (names, key) != NULL;
+        g_free (key);
     } while (found);
+
+    ret = arena_strdup (name);
+    g_free (name);
+    g_free (base);
     return ret;
 }
 
+/*
+ * Index printers by uri and by lower-cased queue name.
+ */
+static void index_printer (PrinterInfo *pi, GHashTable *by_uri, GHashTable *by_name)
+{
+    g_hash_table_insert (by_uri, pi->uri, pi);
+    g_hash_table_insert (by_name, g_ascii_strdown (pi->name, -1), pi);
+}
+
 /*
  * A crappy check to see if a printer uri is local.
  */
@@ -319,156 +1029,349 @@ static gboolean uri_is_local (const gchar *uri)
             strstr (uri, "epson:/")) ? TRUE : FALSE;
 }
 
+static int compare_strings (const void *a, const void *b)
+{
+    return strcmp (*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
 /*
- * Remove the make from the make and model string, if it's there.  The
- * returned string needs to be freed by the caller.
+ * Give each byte of a pattern a class of its own.
  */
-static gchar *model_from_string (const gchar *make_str, const gchar *model_str)
+static void model_matcher_add_classes (ModelMatcher *m, const gchar *pattern)
 {
-    const char *crap[] = { ",", "(", "FOOMATIC/", "- CUPS", "CUPS", "(RECOMMEND",
-                           " POSTSCRIPT ", " PS3 ", " PS -", " PS V", "W/PS" };
-    gchar *make, *ss = NULL, *mdl = NULL;
-    gsize ss_len;
-    int i;
+    for (; *pattern; pattern++) {
+        guchar u = g_ascii_toupper (*pattern);
 
-    g_return_val_if_fail (model_str, NULL);
-    mdl = g_ascii_strup (model_str, -1);
-    make = g_strstrip (g_ascii_strup (make_str, -1));
-    
-    /* strip off known crap from the model field */
-    for (i = 0; i < sizeof(crap) / sizeof(crap[0]); i++) {
-        ss = strstr (mdl, crap[i]);
-        if (ss)
-            *ss = '\0';
+        if (!m->classes[u]) {
+            m->classes[u] = m->n_classes++;
+            m->classes[(guchar) g_ascii_tolower (u)] = m->classes[u];
+        }
     }
+}
 
-    /* strip off spaces */
-    mdl = g_strstrip (mdl);
-    
-    /* look for the make or any of its aliases */
-    ss_len = strlen (make);
-    ss = strstr (mdl, make);
-    if (!ss) {
-        /* see if we have an alias in the string */
-        const gchar **alias = g_hash_table_lookup (alias_map, make);
-        if (!alias)
-            goto done;
+/*
+ * Add a pattern to the trie of a matcher being built.  Returns the
+ * state the pattern ends in.
+ */
+static guint model_matcher_add (ModelMatcher *m, GArray *next, const gchar *pattern)
+{
+    guint state = 0;
 
-        for (; *alias; alias++) {
-            ss = strstr (mdl, *alias);
-            if (ss) {
-                ss_len = strlen (*alias);
-                break;
-            }
+    for (; *pattern; pattern++) {
+        guint c = m->classes[(guchar) *pattern];
+
+        if (!g_array_index (next, guint16, state * m->n_classes + c)) {
+            g_array_index (next, guint16, state * m->n_classes + c) = m->n_states++;
+            g_array_set_size (next, m->n_states * m->n_classes);
         }
-    }
 
-    /* we need strip make or an alias out */
-    if (ss) {
-        gchar *p = ss + ss_len;
-        gchar *tmp = mdl;
-        mdl = g_strdup (p);
-        g_free (tmp);
+        state = g_array_index (next, guint16, state * m->n_classes + c);
     }
 
-    /* strip off spaces one last time */
-    mdl = g_strstrip (mdl);
+    return state;
+}
 
-done:
+/*
+ * Build the matcher for a make: the noise, the make and the make's
+ * aliases, in the order model_from_string() prefers them.
+ */
+static ModelMatcher *model_matcher_new (const gchar *make_str)
+{
+    ModelMatcher *m = g_new0 (ModelMatcher, 1);
+    const gchar * const *aliases = NULL;
+    const gchar *names[MATCHER_MAX_NAMES];
+    GArray *next, *noise, *found;
+    guint16 *fail;
+    GQueue *queue;
+    gchar *make;
+    guint i, c, n_noise;
+
+    make = g_strstrip (g_ascii_strup (make_str ? make_str : "", -1));
+    if (strlen (make)) {
+        names[m->n_names++] = make;
+        aliases = g_hash_table_lookup (alias_map, make);
+    }
+
+    for (; aliases && *aliases && m->n_names < MATCHER_MAX_NAMES; aliases++)
+        names[m->n_names++] = *aliases;
+
+    /* letters are matched case-insensitively, everything else exactly */
+    m->n_classes = 1;
+    for (i = 0; model_noise[i]; i++)
+        model_matcher_add_classes (m, model_noise[i]);
+
+    for (i = 0; i < m->n_names; i++)
+        model_matcher_add_classes (m, names[i]);
+
+    next = g_array_new (FALSE, TRUE, sizeof (guint16));
+    m->n_states = 1;
+    g_array_set_size (next, m->n_classes);
+    noise = g_array_new (FALSE, TRUE, sizeof (guint32));
+    found = g_array_new (FALSE, TRUE, sizeof (guint32));
+
+    for (n_noise = 0; model_noise[n_noise]; n_noise++) {
+        guint state = model_matcher_add (m, next, model_noise[n_noise]);
+
+        g_array_set_size (noise, m->n_states);
+        g_array_index (noise, guint32, state) |= 1 << n_noise;
+    }
+
+    for (i = 0; i < m->n_names; i++) {
+        guint state = model_matcher_add (m, next, names[i]);
+
+        g_array_set_size (found, m->n_states);
+        g_array_index (found, guint32, state) |= 1 << i;
+    }
+
+    g_array_set_size (noise, m->n_states);
+    g_array_set_size (found, m->n_states);
+    m->next = (guint16 *) g_array_free (next, FALSE);
+    m->noise = (guint32 *) g_array_free (noise, FALSE);
+    m->names = (guint32 *) g_array_free (found, FALSE);
+
+    /*
+     * Turn the trie into a DFA, breadth first.  A state also ends
+     * whatever its failure state ends.
+     */
+    fail = g_new0 (guint16, m->n_states);
+    queue = g_queue_new ();
+    g_queue_push_tail (queue, GUINT_TO_POINTER (0));
+    while (!g_queue_is_empty (queue)) {
+        guint state = GPOINTER_TO_UINT (g_queue_pop_head (queue));
+        guint16 *row = m->next + state * m->n_classes;
+
+        for (c = 0; c < m->n_classes; c++) {
+            guint16 t = row[c];
+            guint16 f = state ? m->next[fail[state] * m->n_classes + c] : 0;
+
+            if (!t) {
+                row[c] = f;
+                continue;
+            }
+
+            fail[t] = f;
+            m->noise[t] |= m->noise[f];
+            m->names[t] |= m->names[f];
+            g_queue_push_tail (queue, GUINT_TO_POINTER (t));
+        }
+    }
+
+    g_queue_free (queue);
+    g_free (fail);
     g_free (make);
-    return mdl;
+    return m;
+}
+
+static ModelMatcher *get_model_matcher (const gchar *make_str)
+{
+    ModelMatcher *m;
+
+    if (!make_str)
+        make_str = "";
+
+    m = g_hash_table_lookup (model_matchers, make_str);
+    if (!m) {
+        m = model_matcher_new (make_str);
+        g_hash_table_insert (model_matchers, g_strdup (make_str), m);
+    }
+
+    return m;
 }
 
 /*
- * Extract the vendor, model, serial number, and description from an ieee 1284 id.
- * The returned strings need to be free by the caller.
+ * Remove the make from the make and model string, if it's there.  The
+ * noise is stripped and the make or an alias found in one pass over
+ * the string.  The returned string needs to be freed by the caller.
  */
-static void get_1284_fields (const gchar *id, gchar **vendor, gchar **model, gchar **serial, gchar **desc)
+static gchar *model_from_string (const gchar *make_str, const gchar *model_str)
 {
-    gchar *s, *e, *uid = g_ascii_strup (id, -1);
+    ModelMatcher *m;
+    gsize ends[MATCHER_MAX_NAMES], noise_ends[G_N_ELEMENTS (model_noise)];
+    gsize i, len, start = 0, end;
+    guint state = 0, n;
+    guint32 seen = 0, seen_noise = 0;
+
+    g_return_val_if_fail (model_str, NULL);
+    m = get_model_matcher (make_str);
+    end = len = strlen (model_str);
+
+    /* note where each name and each noise first ends */
+    for (i = 0; i < len; i++) {
+        guint32 names, noise;
 
-    if (vendor) {
-        if ((s = strstr (uid, "MFG:")))
-            s += 4;
-        else if ((s = strstr (uid, "MANUFACTURER:")))
-            s += 13;
+        state = m->next[state * m->n_classes + m->classes[(guchar) model_str[i]]];
+        names = m->names[state] & ~seen;
+        for (n = 0; names; n++, names >>= 1) {
+            if (names & 1)
+                ends[n] = i + 1;
+        }
+        seen |= m->names[state];
 
-        if (s && (e = strchr (s, ';'))) {
-            *e = '\0';
-            *vendor = g_strstrip (g_strdup (s));
+        noise = m->noise[state] & ~seen_noise;
+        for (n = 0; noise; n++, noise >>= 1) {
+            if (noise & 1)
+                noise_ends[n] = i + 1;
         }
+        seen_noise |= m->noise[state];
     }
 
-    if (model) {
-        if ((s = strstr (uid, "MDL:")))
-            s += 4;
-        else if ((s = strstr (uid, "MODEL:")))
-            s += 6;
+    /*
+     * Cut the noise off in turn.  Noise that doesn't fit in what is
+     * left of the model by then doesn't count, so ' PS -' in
+     * 'LaserJet 4 PS - CUPS' is gone with '- CUPS' and the PS stays.
+     */
+    for (n = 0; model_noise[n]; n++) {
+        if ((seen_noise & (1 << n)) && noise_ends[n] <= end)
+            end = noise_ends[n] - strlen (model_noise[n]);
+    }
 
-        if (s && (e = strchr (s, ';'))) {
-            *e = '\0';
-            *model = g_strstrip (g_strdup (s));
+    /* strip the make, or failing that the first alias that's there */
+    for (n = 0; n < m->n_names; n++) {
+        if ((seen & (1 << n)) && ends[n] <= end) {
+            start = ends[n];
+            break;
         }
     }
 
-    if (serial) {
-        if ((s = strstr (uid, "SERN:")))
-            s += 5;
-        else if ((s = strstr (uid, "SERIALNUMBER:")))
-            s += 13; 
-        else if ((s = strstr (uid, ";SN:")))
-            s += 4;
+    while (start < end && g_ascii_isspace (model_str[start]))
+        start++;
+
+    while (end > start && g_ascii_isspace (model_str[end - 1]))
+        end--;
 
-        if (s && (e = strchr (s, ';'))) {
-            *e = '\0';
-            *serial = g_strstrip (g_strdup (s));
+    return g_ascii_strup (model_str + start, end - start);
+}
+
+/*
+ * Split a model into tokens: runs of letters, the series like
+ * 'DESKJET', and runs of digits, the model number like '3550'.
+ * Single letters are mostly suffixes and are dropped.  The tokens
+ * are upper-cased, appended to tokens and need to be freed by the
+ * caller.
+ */
+static void model_tokens (const gchar *str, gsize len, GPtrArray *tokens)
+{
+    gsize i = 0, start;
+
+    while (i < len) {
+        start = i;
+        if (g_ascii_isdigit (str[i])) {
+            for (; i < len && g_ascii_isdigit (str[i]); i++);
+            g_ptr_array_add (tokens, g_strndup (str + start, i - start));
+        } else if (g_ascii_isalpha (str[i])) {
+            for (; i < len && g_ascii_isalpha (str[i]); i++);
+            if (i - start > 1)
+                g_ptr_array_add (tokens, g_ascii_strup (str + start, i - start));
+        } else {
+            i++;
         }
     }
-    
-    if (desc) {
-        if ((s = strstr (uid, "DES:")))
-            s += 4;
-        else if ((s = strstr (uid, "DESCRIPTION:")))
-            s += 12;
-        
-        if (s && (e = strchr (s, ';'))) {
-            *e = '\0';
-            *desc = g_strstrip (g_strdup (s));
+}
+
+/*
+ * Split an IEEE 1284 id into its fields in a single pass.  The fields
+ * point into id, so id has to outlive the result.  Keys are matched
+ * case-insensitively and the last field doesn't need a trailing ';'.
+ */
+static void parse_1284_id (const gchar *id, DeviceId *did)
+{
+    static const struct {
+        const gchar *key;
+        gsize offset;
+    } keys[] = {
+        { "MFG", G_STRUCT_OFFSET (DeviceId, mfg) },
+        { "MANUFACTURER", G_STRUCT_OFFSET (DeviceId, mfg) },
+        { "MDL", G_STRUCT_OFFSET (DeviceId, mdl) },
+        { "MODEL", G_STRUCT_OFFSET (DeviceId, mdl) },
+        { "SN", G_STRUCT_OFFSET (DeviceId, sn) },
+        { "SERN", G_STRUCT_OFFSET (DeviceId, sn) },
+        { "SERIALNUMBER", G_STRUCT_OFFSET (DeviceId, sn) },
+        { "DES", G_STRUCT_OFFSET (DeviceId, des) },
+        { "DESCRIPTION", G_STRUCT_OFFSET (DeviceId, des) },
+        { "CMD", G_STRUCT_OFFSET (DeviceId, cmd) },
+        { "COMMAND SET", G_STRUCT_OFFSET (DeviceId, cmd) }
+    };
+    const gchar *p = id;
+
+    memset (did, 0, sizeof (DeviceId));
+    if (!id)
+        return;
+
+    while (*p) {
+        const gchar *key, *key_end, *val, *val_end;
+        gint i;
+
+        for (; *p == ';' || g_ascii_isspace (*p); p++);
+        if (!*p)
+            break;
+
+        key = p;
+        for (; *p && *p != ':' && *p != ';'; p++);
+        if (*p != ':')
+            continue;
+
+        for (key_end = p; key_end > key && g_ascii_isspace (key_end[-1]); key_end--);
+
+        for (val = p + 1; *val && *val != ';' && g_ascii_isspace (*val); val++);
+        for (p = val; *p && *p != ';'; p++);
+        for (val_end = p; val_end > val && g_ascii_isspace (val_end[-1]); val_end--);
+
+        for (i = 0; i < G_N_ELEMENTS (keys); i++) {
+            IdField *f = G_STRUCT_MEMBER_P (did, keys[i].offset);
+
+            if (strlen (keys[i].key) != key_end - key ||
+                g_ascii_strncasecmp (keys[i].key, key, key_end - key))
+                continue;
+
+            /* the first occurrence wins */
+            if (!f->str && val_end > val) {
+                f->str = val;
+                f->len = val_end - val;
+            }
+            break;
         }
     }
 }
 
 /*
- *  Determines if two printers are the same based on their IEEE 1284 ids.
+ * Compare two id fields case-insensitively.
  */
-static gboolean match_by_1284 (const char *id1, const char *id2)
+static gboolean id_field_equal (const IdField *a, const IdField *b)
 {
-    gboolean ret = FALSE;
-    gchar *man1 = NULL, *man2 = NULL, *mod1 = NULL;
-    gchar *mod2 = NULL, *ser1 = NULL, *ser2 = NULL; 
+    return a->len == b->len && !g_ascii_strncasecmp (a->str, b->str, a->len);
+}
 
-    get_1284_fields (id1, &man1, &mod1, &ser1, NULL);
-    get_1284_fields (id2, &man2, &mod2, &ser2, NULL);
+/*
+ * Compare an id field and a string case-insensitively.
+ */
+static gboolean id_field_equal_str (const IdField *f, const gchar *str)
+{
+    return f->str && strlen (str) == f->len && !g_ascii_strncasecmp (f->str, str, f->len);
+}
 
-    if (man1 && man2 && g_ascii_strcasecmp (man1, man2))
-        goto done;
+/*
+ * Copy an id field.  The returned string needs to be freed by the caller.
+ */
+static gchar *id_field_dup (const IdField *f)
+{
+    return f->str ? g_strndup (f->str, f->len) : NULL;
+}
 
-    if (mod1 && mod2 && g_ascii_strcasecmp (mod1, mod2))
-        goto done;
+/*
+ *  Determines if two printers are the same based on their IEEE 1284 ids.
+ */
+static gboolean match_by_1284 (const DeviceId *id1, const DeviceId *id2)
+{
+    if (id1->mfg.str && id2->mfg.str && !id_field_equal (&id1->mfg, &id2->mfg))
+        return FALSE;
 
-    if (ser1 && ser2 && g_ascii_strcasecmp (ser1, ser2))
-        goto done;
+    if (id1->mdl.str && id2->mdl.str && !id_field_equal (&id1->mdl, &id2->mdl))
+        return FALSE;
 
-    ret = TRUE;
+    if (id1->sn.str && id2->sn.str && !id_field_equal (&id1->sn, &id2->sn))
+        return FALSE;
 
-done:
-    g_free (man1);
-    g_free (man2);
-    g_free (mod1);
-    g_free (mod2);
-    g_free (ser1);
-    g_free (ser2);
-    return ret;
+    return TRUE;
 }
 
 /* 
@@ -476,19 +1379,21 @@ done:
  * Then we assume we are being called via a HAL callout and we use the environment 
  * variables exposed to the HAL callouts. 
  */
-static gboolean printer_matches_hal_properties (PrinterInfo *pi, gchar *hal_udi)
+static gboolean printer_matches_hal_properties (PrinterInfo *pi, const gchar *hal_udi)
 {
     gchar *make = NULL, *model = NULL, *serial = NULL;
     gchar *mm = NULL, *um = NULL, *mdl = NULL;
+    const gchar *vendor;
     gboolean ret = FALSE;
 
-    make = libhal_device_get_property_string (hal_ctx, hal_udi, "printer.vendor", NULL);
-    model = libhal_device_get_property_string (hal_ctx, hal_udi, "printer.product", NULL);
-    serial = libhal_device_get_property_string (hal_ctx, hal_udi, "printer.serial", NULL);
+    make = hal_get_string (hal_udi, "printer.vendor");
+    model = hal_get_string (hal_udi, "printer.product");
+    serial = hal_get_string (hal_udi, "printer.serial");
+    vendor = make;
 
-    log_it ("HAL Printer properties make='%s' model='%s' serial='%s'\n"
-            "Printer properties uri='%s' m_and_m='%s'\n", 
-            make, model, serial, pi->uri, pi->make_and_model);
+    log_debug ("HAL Printer properties make='%s' model='%s' serial='%s'\n"
+                "Printer properties uri='%s' m_and_m='%s'\n", 
+                make, model, serial, pi->uri, pi->make_and_model);
 
     if (!model || !make)
         goto done;
@@ -506,69 +1411,86 @@ static gboolean printer_matches_hal_properties (PrinterInfo *pi, gchar *hal_udi)
                 goto matched;
             }
         } else
-            log_it ("couldn't find a serial number in the backend uri\n");
+            log_debug ("couldn't find a serial number in the backend uri\n");
     }
 
     /* strip spaces */
-    make = g_strstrip (make);
+    vendor = g_strstrip (make);
     model = g_strstrip (model);
 
     /* check our vendor mappings */
-    um = g_ascii_strup (make, -1);
+    um = g_ascii_strup (vendor, -1);
     mm = g_hash_table_lookup (vendor_map, um);
     if (mm)
-        make = mm;
+        vendor = mm;
 
     /* check the model */
-    mdl = model_from_string (make, pi->make_and_model);
+    mdl = model_from_string (vendor, pi->make_and_model);
     if (g_ascii_strcasecmp (mdl, model)) {
-        log_it ("models '%s' and '%s' didn't match with make '%s'\n",
-             mdl, model, make);
+        log_debug ("models '%s' and '%s' didn't match with make '%s'\n",
+                   mdl, model, vendor);
         goto done;
     }
 
 matched:
-    pi->make = g_strdup (make);
-    pi->model = g_strdup (model);
-    pi->serial = g_strdup (serial);
+    /* detected printers are shared, so this might not be the first match */
+    pi->make = arena_intern (vendor);
+    pi->model = arena_intern (model);
+    pi->serial = arena_intern (serial);
     ret = TRUE;
 
 done:
     g_free (mdl);
-    libhal_free_string (make);
-    libhal_free_string (model);
-    libhal_free_string (serial);
+    g_free (um);
+    g_free (make);
+    g_free (model);
+    g_free (serial);
     return ret;
 }
 
+/*
+ * See if the ppd model is the alphabetic series of the printer model
+ * followed by a description, i.e. 'DESKJET' + ' ' + '3550'.
+ */
+static gboolean match_combined_description (const IdField *ppd_model, const IdField *series,
+                                            const gchar *desc)
+{
+    gsize len = strlen (desc);
+
+    if (g_ascii_isalpha (desc[0]))
+        return FALSE;
+
+    log_debug ("Combined alt description is '%.*s %s'\n", (int) series->len, series->str, desc);
+    if (ppd_model->len != series->len + 1 + len ||
+        g_ascii_strncasecmp (ppd_model->str, series->str, series->len) ||
+        ppd_model->str[series->len] != ' ' ||
+        g_ascii_strncasecmp (ppd_model->str + series->len + 1, desc, len))
+        return FALSE;
+
+    log_debug ("Combined alt description '%.*s %s' matched '%.*s'\n", (int) series->len,
+                series->str, desc, (int) ppd_model->len, ppd_model->str);
+    return TRUE;
+}
+
 /*
  * The description field is a string that should be presented to users to represent
  * the printer.  Sometimes it's just the model.
  */
-static gboolean match_from_descriptions (PrinterInfo *pi, gchar *ppd_model, gchar *printer_model)
+static gboolean match_from_descriptions (PrinterInfo *pi, const IdField *ppd_model,
+                                         const IdField *printer_model)
 {
-    gboolean ret = FALSE;
-    gchar *d1 = NULL, *d2 = NULL, *m, *result, *pm = g_strdup (printer_model);
-    
-    if (pi->description)
-        d1 = g_ascii_strup (pi->description, -1);
-    
-    if (pi->alt_description)
-        d2 = g_ascii_strup (pi->alt_description, -1);
+    const gchar *d1 = pi->description, *d2 = pi->alt_description;
+    IdField series;
 
-    log_it ("Checking descriptions '%s' and '%s' against '%s'\n",
-            d1, d2, ppd_model);
+    log_debug ("Checking descriptions '%s' and '%s' against '%.*s'\n",
+                d1, d2, (int) ppd_model->len, ppd_model->str);
 
     /* see if the ppd model matches the descriptions */
-    if (d1 && !g_ascii_strcasecmp (d1, ppd_model)) {
-        ret = TRUE;
-        goto done;
-    }
+    if (d1 && id_field_equal_str (ppd_model, d1))
+        return TRUE;
     
-    if (d2 && !g_ascii_strcasecmp (d2, ppd_model)) {
-        ret = TRUE;
-        goto done;
-    }
+    if (d2 && id_field_equal_str (ppd_model, d2))
+        return TRUE;
 
     /*
      * Some printers report different descriptions depending on the backend,
@@ -576,859 +1498,3952 @@ static gboolean match_from_descriptions (PrinterInfo *pi, gchar *ppd_model, gcha
      * actual printer model is deskjet 3550.  Check for this case.
      * Also, I hate printing.
      */
-    for (m = pm; m != '\0' && isalpha (*m); m++);
-    *m = '\0';
-    
-    if (d1 && !isalpha (d1[0])) {
-        result = g_strconcat (pm, " ", d1, NULL);
-        log_it ("Combined alt description is '%s'\n", result);
-        if (!g_ascii_strcasecmp (result, ppd_model)) {
-            log_it ("Combined alt description '%s' matched '%s'\n", result, ppd_model);
-            g_free (result);
-            ret = TRUE;
-            goto done;
-        }
-        
-        g_free (result);
-    }
+    series.str = printer_model->str;
+    for (series.len = 0; series.len < printer_model->len &&
+         g_ascii_isalpha (series.str[series.len]); series.len++);
+
+    if (d1 && match_combined_description (ppd_model, &series, d1))
+        return TRUE;
     
-    if (d2 && !isalpha (d2[0])) {
-        result = g_strconcat (pm, " ", d2, NULL);
-        log_it ("Combined alt description is '%s'\n", result);
-        if (!g_ascii_strcasecmp (result, ppd_model)) {
-            log_it ("Combined alt description '%s' matched '%s'\n", result, ppd_model);
-            g_free (result);
-            ret = TRUE;
-            goto done;
-        }
-        
-        g_free (result);
-    }
+    if (d2 && match_combined_description (ppd_model, &series, d2))
+        return TRUE;
 
-done:
-    g_free (d1);
-    g_free (d2);
-    g_free (pm);
-    return ret;
+    return FALSE;
 }
 
 /*
- * Return the best PPD file to use for a given printer.  The
- * returned string must be freed by the caller.
+ * Send a request to cupsd and wait for the answer, timing it as the
+ * phase name.  The request is freed.
  */
-static gchar *get_best_ppd (PrinterInfo *pi)
+static ipp_t *cups_do_request (ipp_t *request, const gchar *name)
 {
-    gchar *ppd = NULL;
-    ipp_t *request, *response;
-    ipp_attribute_t *attr;
-    PPDScore ppd_score = PPD_NO_MATCH;
+    TraceSpan span;
+    ipp_t *response;
 
-    /* get the list of ppds */
-    request = ippNewRequest (CUPS_GET_PPDS);
+    trace_begin (&span);
     response = cupsDoRequest (global_cups_connection, request, "/");
-    if (!response || response->request.status.status_code > IPP_OK_CONFLICT) {
-        log_it ("Failed to get ppds for '%s'\n", pi->make);
-        goto done;
-    } 
+    trace_add (TRACE_IPP_REQUESTS, 1);
+    if (response)
+        trace_add (TRACE_BYTES_RECEIVED, ippLength (response));
+    trace_end (&span, name);
 
-    /* 
-     * Look for ppds that match our model with priority: 
-     * manufacturer-PPD > recommended > simple match
-     */
-    for (attr = response->attrs; attr; attr = attr ? attr->next : NULL) {
-        gchar *ppd_model = NULL;
-        const gchar *name = NULL, *make_and_model = NULL, *id = NULL;
-        gboolean match = FALSE;
-        
-        while (attr && attr->group_tag != IPP_TAG_PRINTER)
-            attr = attr->next;
+    return response;
+}
 
-        if (!attr)
-            goto done;
+/*
+ * Send a request on a connection of our own without waiting for the
+ * answer.  The request isn't freed.
+ */
+static gboolean cups_send_request (http_t *http, ipp_t *request)
+{
+    ipp_state_t state;
 
-        for (; attr && attr->group_tag == IPP_TAG_PRINTER; attr = attr->next) {
-            if (!strcmp (attr->name, "ppd-name") && attr->value_tag == IPP_TAG_NAME) {
-                name = attr->values[0].string.text;
-            } else if (!strcmp (attr->name, "ppd-make-and-model") && attr->value_tag == IPP_TAG_TEXT) {
-                make_and_model = attr->values[0].string.text;
-            } else if (!strcmp (attr->name, "ppd-device-id") && attr->value_tag == IPP_TAG_TEXT) {
-                id = attr->values[0].string.text;
-            } 
-        }
+    httpClearFields (http);
+    httpSetField (http, HTTP_FIELD_CONTENT_TYPE, "application/ipp");
+    httpSetLength (http, ippLength (request));
+    if (httpPost (http, "/"))
+        return FALSE;
 
-        if (pi->device_id && id && strlen (id)) {
-            gchar *pm;
+    while ((state = ippWrite (http, request)) != IPP_DATA) {
+        if (state == IPP_ERROR)
+            return FALSE;
+    }
 
-            /* match with ieee 1284 ids */
-            log_it ("Matching with 1284 ids:\n\t'%s'\n\t'%s'\n", pi->device_id, id);
-            get_1284_fields (pi->device_id, NULL, &pm, NULL, NULL);
-            get_1284_fields (id, NULL, &ppd_model, NULL, NULL);
-            log_it ("Extracted models are '%s' (printer) and '%s' (ppd)\n", pm, ppd_model);
-            if (!ppd_model || !pm)
-                continue;
+    trace_add (TRACE_IPP_REQUESTS, 1);
+    return TRUE;
+}
 
-            match = !g_ascii_strcasecmp (ppd_model, pm) ? TRUE : FALSE;
-            if (!match)
-                match = match_from_descriptions (pi, ppd_model, pm);
+/*
+ * Build the request for cupsd's list of PPDs.  Only the attributes we
+ * look at are requested, and if make or device_id are given
+ * cups-driverd only returns the PPDs that match them.
+ */
+static ipp_t *new_get_ppds_request (const gchar *make, const gchar *device_id)
+{
+    static const char * const attrs[] = {
+        "ppd-name", "ppd-make", "ppd-make-and-model", "ppd-device-id"
+    };
+    ipp_t *request;
 
-            log_it ("Result for matching '%s' and '%s' was %d\n\n", ppd_model, pm, match);
-        } else {
-            /* match with model strings */
-            log_it ("Matching with model strings '%s' and '%s'\n", pi->model, make_and_model);
-            ppd_model = model_from_string (pi->make, make_and_model);
-            log_it ("Extracted model string from ppd was '%s'\n", ppd_model);
-            if (!ppd_model)
-                continue;
+    request = ippNewRequest (CUPS_GET_PPDS);
+    ippAddStrings (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "requested-attributes",
+                   G_N_ELEMENTS (attrs), NULL, attrs);
 
-            match = !g_ascii_strcasecmp (ppd_model, pi->model) ? TRUE : FALSE;
-            log_it ("Result for matching '%s' and '%s' was %d\n\n", ppd_model, pi->model, match);
-        }
+    if (make)
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_TEXT, "ppd-make", NULL, make);
 
-        if (match) {
-            if (strstr (name, "manufacturer-PPDs")) {
-                if (ppd)
-                    g_free (ppd);
-                ppd = g_strdup (name);
-                goto done;
-            } else if (strstr (make_and_model, "(recommended)")) {
-                if (ppd_score < PPD_RECOMMENDED) {
-                    if (ppd)
-                        g_free (ppd);
-                    ppd = g_strdup (name);
-                    ppd_score = PPD_RECOMMENDED;
-                }
-            } else {
-                if (ppd_score < PPD_MATCH) {
-                    if (ppd)
-                        g_free (ppd);
-                    ppd = g_strdup (name);
-                    ppd_score = PPD_MATCH;
-                }
-            }
-        }
+    if (device_id)
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_TEXT, "ppd-device-id", NULL, device_id);
 
-        g_free (ppd_model);
+    return request;
+}
+
+/*
+ * Ask cupsd for its list of PPDs, see new_get_ppds_request().  The
+ * response needs to be freed with ippDelete().
+ */
+static ipp_t *get_ppds (const gchar *make, const gchar *device_id)
+{
+    ipp_t *response;
+
+    response = cups_do_request (new_get_ppds_request (make, device_id), "get_ppds");
+    if (!response || response->request.status.status_code > IPP_OK_CONFLICT) {
+        log_error ("Failed to get ppds (make='%s' device-id='%s')\n", make, device_id);
+        ippDelete (response);
+        return NULL;
     }
 
-done:
-    ippDelete (response);
-    return ppd;
+    return response;
 }
 
 /*
- * Get the list of detected printers from a cups backend.
+ * Rank a PPD: manufacturer-PPD > recommended > simple match.
  */
-static gboolean get_local_printers (GSList **list, const gchar *backend)
+static PPDScore get_ppd_score (const gchar *name, const gchar *make_and_model)
 {
-    gchar *path = g_build_path ("/", CUPS_BACKEND_DIR, backend, NULL);
-    gchar *argv[] = { path, NULL };
-    GError *err = NULL;
-    FILE *fp;
-    gboolean ret = FALSE;
-    GPid child;
-    gint status;
-    gint std_out;
-    gchar buff[512];
-    
-    ret = g_spawn_async_with_pipes (NULL, argv, NULL,
-                                    G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDERR_TO_DEV_NULL,
-                                    NULL, NULL, &child, NULL, &std_out, NULL, &err);
-    if (!ret) {
-        log_it ("%s\n", err->message);
-        g_error_free (err);
-        g_free (path);
-        return FALSE;
-    }
+    if (name && strstr (name, "manufacturer-PPDs"))
+        return PPD_MANUFACTURER;
 
-    g_free (path);
-    fp = fdopen (std_out, "r");
-    if (!fp) {
-        log_it ("%s\n", strerror (errno));
-        return FALSE;
-    }
-    
-    while (fgets (buff, 512, fp)) {
-        PrinterInfo *pi;
-        gchar *start, *end, *uri, *p;
-        gsize uri_len;
-        gint i;
+    if (make_and_model && strstr (make_and_model, "(recommended)"))
+        return PPD_RECOMMENDED;
 
-        /* all local printers have direct as the first field */
-        if (strncmp ("direct", buff, 6))
-            continue;
+    return PPD_MATCH;
+}
 
-        start = buff + 7;
+/*
+ * Upper-case a make and run it through our vendor mappings.  The
+ * returned string needs to be freed by the caller.
+ */
+static gchar *normalize_make (const gchar *make)
+{
+    gchar *um = g_strstrip (g_ascii_strup (make, -1));
+    const gchar *mm = g_hash_table_lookup (vendor_map, um);
 
-        /* get the uri */
-        end = strstr (start, " ");
-        if (!end)
-            continue;
+    if (mm) {
+        g_free (um);
+        um = g_ascii_strup (mm, -1);
+    }
 
-        *end = '\0';
+    return um;
+}
 
-        /* make sure it's a valid uri for this backend */
-        uri = g_strconcat (backend, ":/", NULL);
-        uri_len = strlen (uri); 
-        if (strncmp (start, uri, uri_len)) {
-            g_free (uri);
-            continue;
-        }
+/*
+ * Append an upper-cased copy of str to key with runs of whitespace
+ * collapsed and the ends trimmed.
+ */
+static void append_normalized (GString *key, const gchar *str)
+{
+    gboolean space = FALSE;
 
-        g_free (uri);
-        pi = g_new0 (PrinterInfo, 1);
-        pi->uri = g_strdup (start);
-        
-        /* look for make and model */
-        start = strchr (end + 1, '"');
-        if (!start) {
-            free_printer_info (pi, NULL);
-            continue;
-        }
+    for (; *str && g_ascii_isspace (*str); str++);
 
-        start++;
-        end = strchr (start + 1, '"');
-        if (!end) {
-            free_printer_info (pi, NULL);
+    for (; *str; str++) {
+        if (g_ascii_isspace (*str)) {
+            space = TRUE;
             continue;
         }
 
-        *(end++) = '\0';
-        pi->make_and_model = g_strdup (start);
-       
-        /* look for the device-id, which is optional */
-        for (i = 0, p = end + 1; *p != '\0'; p++) {
-            if (*p != '"')
-                continue;
-
-            i++;
-            if (i == 3) {
-                start = p;
-            } else if (i == 4) {
-                *(p + 1) = '\0';
-                pi->device_id = g_strdup (start);
-                break;
-            }
-        }
+        if (space)
+            g_string_append_c (key, ' ');
 
-        *list = g_slist_append (*list, pi);
-        log_it ("local printer '%s' - '%s'\n", pi->uri, pi->make_and_model);
+        g_string_append_c (key, g_ascii_toupper (*str));
+        space = FALSE;
     }
+}
 
-    fclose (fp);
-
-    if (waitpid (child, &status, 0) == -1 ||
-        WEXITSTATUS (status) != 0)
-        ret = FALSE;
+/*
+ * Build a PPD index key from a key type, a make and a model.  The
+ * returned string needs to be freed by the caller.
+ */
+static gchar *ppd_index_key (const gchar *type, const gchar *make, const gchar *model)
+{
+    GString *key = g_string_new (type);
 
-    g_spawn_close_pid (child);
-    return ret;
+    g_string_append_c (key, ':');
+    append_normalized (key, make);
+    g_string_append_c (key, '\x1f');
+    append_normalized (key, model);
+    return g_string_free (key, FALSE);
 }
 
 /*
- * See if a usb backend printer is detected by 'backend' and, if so, set 'match'.
+ * Build the PPD index key for a 1284 id.  Returns NULL if the id
+ * doesn't have both MFG and MDL fields.  The returned string needs
+ * to be freed by the caller.
  */
-static gboolean has_preferred_backend_match (PrinterInfo *usbp, PrinterInfo **match,
-                                               const gchar *backend)
+static gchar *ppd_index_id_key (const DeviceId *id)
 {
-    GSList *detected = NULL, *p;
+    gchar *mfg, *mdl, *nm, *key;
 
-    if (!get_local_printers (&detected, backend)) {
-        log_it ("Failed to list printers from '%s' backend\n", backend);
-        return FALSE;
-    }
+    if (!id->mfg.str || !id->mdl.str)
+        return NULL;
 
-    /*
-     * The flow of this is funny because we want to free all nodes
-     * except the one that matches.
-     */
-    for (p = detected; p; p = p->next) {
-        PrinterInfo *sp = p->data;
-        gchar *s1, *s2;
+    mfg = id_field_dup (&id->mfg);
+    mdl = id_field_dup (&id->mdl);
+    nm = normalize_make (mfg);
+    key = ppd_index_key ("ID", nm, mdl);
+
+    g_free (nm);
+    g_free (mdl);
+    g_free (mfg);
+    return key;
+}
+
+/*
+ * FNV-1a.  The index lives on disk, so we can't use g_str_hash here.
+ */
+static guint32 ppd_index_hash (const gchar *key)
+{
+    guint32 hash = 2166136261U;
+
+    for (; *key; key++) {
+        hash ^= (guchar) *key;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static const gchar *ppd_index_string (PPDIndex *idx, guint32 offset)
+{
+    return offset < idx->header->strings_size ? idx->strings + offset : NULL;
+}
+
+/*
+ * Make sure a section of count * size bytes at offset fits in the file.
+ */
+static gboolean ppd_index_section_ok (gsize length, guint32 offset, guint32 count, gsize size)
+{
+    return (offset % sizeof (guint32)) == 0 &&
+           (guint64) offset + (guint64) count * size <= length;
+}
+
+/*
+ * Map the PPD index if it exists and was built from the current CUPS
+ * PPD cache.
+ */
+static PPDIndex *ppd_index_open (const struct stat *cache)
+{
+    GMappedFile *file;
+    const PPDIndexHeader *h;
+    const gchar *data;
+    PPDIndex *idx;
+    gsize length;
+
+    file = g_mapped_file_new (PPD_INDEX_FILE, FALSE, NULL);
+    if (!file)
+        return NULL;
+
+    data = g_mapped_file_get_contents (file);
+    length = g_mapped_file_get_length (file);
+    h = (const PPDIndexHeader *) data;
+
+    if (length < sizeof (PPDIndexHeader) ||
+        h->magic != PPD_INDEX_MAGIC || h->version != PPD_INDEX_VERSION) {
+        log_it ("Ignoring invalid ppd index\n");
+        goto bad;
+    }
+
+    if (h->cache_mtime != (gint64) cache->st_mtime ||
+        h->cache_size != (gint64) cache->st_size) {
+        log_it ("ppd index is out of date\n");
+        goto bad;
+    }
+
+    if (!h->n_buckets || (h->n_buckets & (h->n_buckets - 1)) ||
+        !ppd_index_section_ok (length, h->entries_offset, h->n_entries, sizeof (PPDIndexEntry)) ||
+        !ppd_index_section_ok (length, h->keys_offset, h->n_keys, sizeof (PPDIndexKey)) ||
+        !ppd_index_section_ok (length, h->buckets_offset, h->n_buckets, sizeof (guint32)) ||
+        !ppd_index_section_ok (length, h->postings_offset, h->n_postings, sizeof (guint32)) ||
+        !ppd_index_section_ok (length, h->strings_offset, h->strings_size, 1) ||
+        !h->strings_size || data[h->strings_offset + h->strings_size - 1] != '\0') {
+        log_error ("Ignoring corrupt ppd index\n");
+        goto bad;
+    }
 
-        if (*match) {
-            free_printer_info (sp, NULL);
+    idx = g_new0 (PPDIndex, 1);
+    idx->file = file;
+    idx->header = h;
+    idx->entries = (const PPDIndexEntry *) (data + h->entries_offset);
+    idx->keys = (const PPDIndexKey *) (data + h->keys_offset);
+    idx->buckets = (const guint32 *) (data + h->buckets_offset);
+    idx->postings = (const guint32 *) (data + h->postings_offset);
+    idx->strings = data + h->strings_offset;
+    return idx;
+
+bad:
+    g_mapped_file_free (file);
+    return NULL;
+}
+
+static void ppd_index_close (void)
+{
+    if (!ppd_index)
+        return;
+
+    g_mapped_file_free (ppd_index->file);
+    g_free (ppd_index);
+    ppd_index = NULL;
+}
+
+/*
+ * Find a key in the index.  Returns NULL if the key isn't there.
+ */
+static const PPDIndexKey *ppd_index_lookup (PPDIndex *idx, const gchar *key)
+{
+    const PPDIndexHeader *h = idx->header;
+    guint32 hash = ppd_index_hash (key);
+    guint32 mask = h->n_buckets - 1;
+    guint32 i, n;
+
+    for (i = hash & mask, n = 0; n < h->n_buckets; i = (i + 1) & mask, n++) {
+        const PPDIndexKey *k;
+        const gchar *s;
+
+        if (!idx->buckets[i] || idx->buckets[i] > h->n_keys)
+            return NULL;
+
+        k = &idx->keys[idx->buckets[i] - 1];
+        if (k->hash != hash || !(s = ppd_index_string (idx, k->key)) || strcmp (s, key))
             continue;
-        }
 
-        if (usbp->device_id && sp->device_id) {
-            /* match by ieee1284 ids */
-            if (match_by_1284 (sp->device_id, usbp->device_id)) {
-                
-                *match = sp;
-                get_1284_fields (sp->device_id, NULL, NULL, NULL, &sp->description);
-                get_1284_fields (usbp->device_id, NULL, NULL, NULL, &sp->alt_description);
-                continue;
-            }
-        } else {
-            /* match by make and model */
-            if (g_ascii_strcasecmp (usbp->make_and_model, sp->make_and_model)) {
-                free_printer_info (sp, NULL);
-                continue;
-            }
+        if (!k->count || (guint64) k->first + k->count > h->n_postings)
+            return NULL;
 
-            s1 = strstr (usbp->uri, "?serial=");
-            s2 = strstr (sp->uri, "?serial=");
+        return k;
+    }
 
-            /* check the serial numbers if both printers have them */
-            if (s1 && s2) {
-                s1 += 8;
-                s2 += 8;
-                
-                if (!g_ascii_strcasecmp (s1, s2)) {
-                    *match = sp;
-                    continue;
-                }
-            } else {
-                *match = sp;
-                continue;
-            }
-        }
+    return NULL;
+}
 
-        free_printer_info (sp, NULL);
+typedef struct _PPDIndexBuilder {
+    GArray *entries;
+    GArray *keys;
+    GArray *postings;
+    GString *strings;
+    guint32 *buckets;
+    guint32 n_buckets;
+} PPDIndexBuilder;
+
+static guint32 ppd_index_add_string (PPDIndexBuilder *b, const gchar *str)
+{
+    guint32 offset = b->strings->len;
+
+    g_string_append_len (b->strings, str, strlen (str) + 1);
+    return offset;
+}
+
+static void ppd_index_add_key (GHashTable *keys, gchar *key, guint32 entry)
+{
+    GArray *postings = g_hash_table_lookup (keys, key);
+
+    if (!postings) {
+        postings = g_array_new (FALSE, FALSE, sizeof (guint32));
+        g_hash_table_insert (keys, key, postings);
+    } else {
+        g_free (key);
+        /* a model can have the same token twice */
+        if (g_array_index (postings, guint32, postings->len - 1) == entry)
+            return;
     }
 
-    g_slist_free (detected);
-    return *match ? TRUE : FALSE;
+    g_array_append_val (postings, entry);
 }
 
 /*
- * Get the printers that the cups backends detects.
+ * Add a token key for each token of a PPD's model.
  */
-static gboolean get_detected_printers (GSList **list)
+static void ppd_index_add_tokens (GHashTable *keys, const gchar *make, const gchar *model,
+                                  gsize len, guint32 entry)
 {
-    GSList *ret = NULL, *p;
-    const char *pref_list[] = { "hp", "epson", "canon" };
-    int i;
+    GPtrArray *tokens = g_ptr_array_new ();
+    guint i;
 
-    if (!get_local_printers (&ret, "usb")) {
-        log_it ("Failed to get printers from usb backend\n");
-        return FALSE;
+    model_tokens (model, len, tokens);
+    for (i = 0; i < tokens->len; i++) {
+        ppd_index_add_key (keys, ppd_index_key ("TK", make, g_ptr_array_index (tokens, i)), entry);
+        g_free (g_ptr_array_index (tokens, i));
     }
 
-    /* 
-     * See if the detected usb printers match one of printers
-     * detected by the preferred backends.
-     */
-    for (p = ret; p; p = p->next) {
-        PrinterInfo *match = NULL, *pi = p->data;
+    g_ptr_array_free (tokens, TRUE);
+}
 
-        for (i = 0; i < sizeof(pref_list) / sizeof(pref_list[0]); i++) {
-            if (has_preferred_backend_match (pi, &match, pref_list[i])) {
-                log_it ("preferring '%s' over '%s'\n", match->uri, pi->uri);
-                free_printer_info (pi, NULL);
-                p->data = match;
-                break;
-            }
+static void free_postings (gpointer data)
+{
+    g_array_free (data, TRUE);
+}
+
+/*
+ * Write out one key and its postings, best PPDScore tier first so
+ * that a lookup only has to look at the first posting.
+ */
+static void ppd_index_write_key (gpointer key, gpointer value, gpointer user_data)
+{
+    PPDIndexBuilder *b = user_data;
+    GArray *postings = value;
+    PPDIndexKey k;
+    guint32 i, n, mask = b->n_buckets - 1;
+    gint score;
+
+    k.hash = ppd_index_hash (key);
+    k.key = ppd_index_add_string (b, key);
+    k.first = b->postings->len;
+    k.count = postings->len;
+
+    for (score = PPD_MANUFACTURER; score > PPD_NO_MATCH; score--) {
+        for (i = 0; i < postings->len; i++) {
+            guint32 e = g_array_index (postings, guint32, i);
+            if (g_array_index (b->entries, PPDIndexEntry, e).score == score)
+                g_array_append_val (b->postings, e);
         }
     }
 
-    *list = ret;
-    return TRUE;
+    g_array_append_val (b->keys, k);
+    n = b->keys->len;
+    for (i = k.hash & mask; b->buckets[i]; i = (i + 1) & mask);
+    b->buckets[i] = n;
 }
 
 /*
- * Get the list of printers already added to cups.
+ * Download the PPD catalog once and write out the PPD index.
  */
-static gboolean get_cups_printers (GSList **list)
+static gboolean ppd_index_build (void)
 {
-    ipp_t *request, *response;
+    PPDIndexBuilder b;
+    PPDIndexHeader h;
+    GHashTable *keys;
+    GString *data;
+    GError *err = NULL;
+    ipp_t *response;
     ipp_attribute_t *attr;
+    struct stat before, cache;
+    gboolean ret = FALSE;
 
-    request = ippNewRequest (CUPS_GET_PRINTERS);
-    response = cupsDoRequest (global_cups_connection, request, "/");
-    if (!response || response->request.status.status_code > IPP_OK_CONFLICT) {
-        log_it ("Failed to get the list of printers from cupsd\n");
+    /* without the cache there's nothing to tell when the index is stale */
+    if (stat (CUPS_PPD_CACHE, &before)) {
+        log_it ("Not building ppd index, can't stat '%s': %s\n", CUPS_PPD_CACHE, strerror (errno));
         return FALSE;
     }
 
-    for (attr = response->attrs; attr; attr = attr->next) {
-        PrinterInfo *pi;
+    response = get_ppds (NULL, NULL);
+    if (!response)
+        return FALSE;
 
-        while (attr != NULL && attr->group_tag != IPP_TAG_PRINTER)
+    /* cups-driverd refreshes its cache when answering, so stat it again */
+    if (stat (CUPS_PPD_CACHE, &cache)) {
+        log_it ("Not building ppd index, can't stat '%s': %s\n", CUPS_PPD_CACHE, strerror (errno));
+        ippDelete (response);
+        return FALSE;
+    }
+
+    if (cache.st_mtime != before.st_mtime || cache.st_size != before.st_size)
+        log_debug ("cups-driverd refreshed '%s'\n", CUPS_PPD_CACHE);
+
+    b.entries = g_array_new (FALSE, FALSE, sizeof (PPDIndexEntry));
+    b.keys = g_array_new (FALSE, FALSE, sizeof (PPDIndexKey));
+    b.postings = g_array_new (FALSE, FALSE, sizeof (guint32));
+    b.strings = g_string_new (NULL);
+    keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, free_postings);
+
+    for (attr = response->attrs; attr; attr = attr ? attr->next : NULL) {
+        const gchar *name = NULL, *make = NULL, *make_and_model = NULL, *id = NULL;
+        PPDIndexEntry entry;
+        guint32 n;
+
+        while (attr && attr->group_tag != IPP_TAG_PRINTER)
             attr = attr->next;
 
         if (!attr)
             break;
 
-        pi = g_new0 (PrinterInfo, 1);
-
         for (; attr && attr->group_tag == IPP_TAG_PRINTER; attr = attr->next) {
-            if (!strncmp (attr->name, "device-uri", 10) && attr->value_tag == IPP_TAG_URI) {
-                pi->uri = g_strdup (attr->values[0].string.text);
-            } else if (!strncmp (attr->name, "printer-name", 12) && attr->value_tag == IPP_TAG_NAME) {
-                pi->name = g_strdup (attr->values[0].string.text);
-            } else if (!strcmp ("printer-make-and-model", attr->name)) {
-                pi->make_and_model = g_strdup (attr->values[0].string.text);
-            } 
+            if (!strcmp (attr->name, "ppd-name") && attr->value_tag == IPP_TAG_NAME) {
+                name = attr->values[0].string.text;
+            } else if (!strcmp (attr->name, "ppd-make") && attr->value_tag == IPP_TAG_TEXT) {
+                make = attr->values[0].string.text;
+            } else if (!strcmp (attr->name, "ppd-make-and-model") && attr->value_tag == IPP_TAG_TEXT) {
+                make_and_model = attr->values[0].string.text;
+            } else if (!strcmp (attr->name, "ppd-device-id") && attr->value_tag == IPP_TAG_TEXT) {
+                id = attr->values[0].string.text;
+            }
         }
 
-        if (!pi->uri || !pi->name) {
-            free_printer_info (pi, NULL);
-        } else {
-            *list = g_slist_append (*list, pi);
-            log_it ("CUPS printer '%s' - '%s'\n", pi->uri, pi->name);
+        trace_add (TRACE_PPDS_SCANNED, 1);
+        if (!name || !make_and_model)
+            continue;
+
+        n = b.entries->len;
+        entry.name = ppd_index_add_string (&b, name);
+        entry.make_and_model = ppd_index_add_string (&b, make_and_model);
+        entry.id_model = PPD_INDEX_NO_STRING;
+        entry.model = PPD_INDEX_NO_STRING;
+        entry.score = get_ppd_score (name, make_and_model);
+
+        if (id && strlen (id)) {
+            DeviceId did;
+            gchar *key;
+
+            parse_1284_id (id, &did);
+            key = ppd_index_id_key (&did);
+            if (key) {
+                gchar *mfg = id_field_dup (&did.mfg);
+                gchar *mdl = id_field_dup (&did.mdl);
+                gchar *nm = normalize_make (make ? make : mfg);
+
+                ppd_index_add_key (keys, key, n);
+                entry.id_model = ppd_index_add_string (&b, mdl);
+                ppd_index_add_tokens (keys, nm, did.mdl.str, did.mdl.len, n);
+                g_free (nm);
+                g_free (mdl);
+                g_free (mfg);
+            }
         }
-        
-        if (!attr)
-            break;
+
+        if (make) {
+            gchar *nm = normalize_make (make);
+            gchar *model = model_from_string (nm, make_and_model);
+
+            if (model && strlen (model)) {
+                ppd_index_add_key (keys, ppd_index_key ("MM", nm, model), n);
+                entry.model = ppd_index_add_string (&b, model);
+                ppd_index_add_tokens (keys, nm, model, strlen (model), n);
+            }
+
+            g_free (model);
+            g_free (nm);
+        }
+
+        g_array_append_val (b.entries, entry);
     }
 
     ippDelete (response);
-    return TRUE;
+
+    for (b.n_buckets = 16; b.n_buckets < 2 * g_hash_table_size (keys); b.n_buckets <<= 1);
+    b.buckets = g_new0 (guint32, b.n_buckets);
+    g_hash_table_foreach (keys, ppd_index_write_key, &b);
+    g_hash_table_destroy (keys);
+
+    memset (&h, 0, sizeof (h));
+    h.magic = PPD_INDEX_MAGIC;
+    h.version = PPD_INDEX_VERSION;
+    h.cache_mtime = cache.st_mtime;
+    h.cache_size = cache.st_size;
+    h.n_entries = b.entries->len;
+    h.n_keys = b.keys->len;
+    h.n_buckets = b.n_buckets;
+    h.n_postings = b.postings->len;
+    h.entries_offset = sizeof (h);
+    h.keys_offset = h.entries_offset + h.n_entries * sizeof (PPDIndexEntry);
+    h.buckets_offset = h.keys_offset + h.n_keys * sizeof (PPDIndexKey);
+    h.postings_offset = h.buckets_offset + h.n_buckets * sizeof (guint32);
+    h.strings_offset = h.postings_offset + h.n_postings * sizeof (guint32);
+    h.strings_size = b.strings->len;
+
+    data = g_string_sized_new (h.strings_offset + h.strings_size);
+    g_string_append_len (data, (gchar *) &h, sizeof (h));
+    g_string_append_len (data, b.entries->data, h.n_entries * sizeof (PPDIndexEntry));
+    g_string_append_len (data, b.keys->data, h.n_keys * sizeof (PPDIndexKey));
+    g_string_append_len (data, (gchar *) b.buckets, h.n_buckets * sizeof (guint32));
+    g_string_append_len (data, b.postings->data, h.n_postings * sizeof (guint32));
+    g_string_append_len (data, b.strings->str, h.strings_size);
+
+    if (g_mkdir_with_parents (CACHE_DIR, 0755)) {
+        log_error ("Failed to create '%s': %s\n", CACHE_DIR, strerror (errno));
+    } else if (!g_file_set_contents (PPD_INDEX_FILE, data->str, data->len, &err)) {
+        log_error ("Failed to write ppd index: %s\n", err->message);
+        g_error_free (err);
+    } else {
+        log_it ("Wrote ppd index with %u ppds and %u keys\n", h.n_entries, h.n_keys);
+        ret = TRUE;
+    }
+
+    g_string_free (data, TRUE);
+    g_free (b.buckets);
+    g_string_free (b.strings, TRUE);
+    g_array_free (b.postings, TRUE);
+    g_array_free (b.keys, TRUE);
+    g_array_free (b.entries, TRUE);
+    return ret;
 }
 
 /*
- * Add and enable a new print queue.
+ * Return the PPD index, rebuilding it first if the CUPS PPD cache
+ * has changed since it was written.
  */
-static gboolean add_print_queue (const gchar *uri, const gchar *ppd_file, const gchar *printer_name)
+static PPDIndex *get_ppd_index (void)
 {
-    ipp_t *request, *response;
-    gboolean ret = FALSE;
-	gchar local_uri [HTTP_MAX_URI + 1];
-  
-    log_it ("adding queue with uri='%s' ppd='%s' name='%s'\n",
-         uri, ppd_file, printer_name);
-    g_snprintf (local_uri, sizeof local_uri - 1,
-		        "ipp://localhost/printers/%s", printer_name);
-    
-    request = ippNewRequest (CUPS_ADD_MODIFY_PRINTER);
-	ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
-		          "printer-uri", NULL, local_uri);
-	ippAddString (request,	IPP_TAG_PRINTER, IPP_TAG_NAME,
-		          "printer-name", NULL, g_strdup (printer_name));
-	ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_NAME,
-		          "ppd-name", NULL, g_strdup (ppd_file));
-	ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_URI,
-		          "device-uri", NULL, uri);
-	ippAddBoolean (request, IPP_TAG_PRINTER, "printer-is-accepting-jobs", 1);
-	ippAddInteger(request, IPP_TAG_PRINTER, IPP_TAG_ENUM, "printer-state",
-                  IPP_PRINTER_IDLE);
+    struct stat cache;
 
-    if (config->default_policy)
-        ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_NAME,
-                      "printer-op-policy", NULL, g_strdup (config->default_policy));
+    if (ppd_index || ppd_index_tried)
+        return ppd_index;
 
-    response = cupsDoRequest (global_cups_connection, request, "/");
-    if (!response || response->request.status.status_code > IPP_OK_CONFLICT) {
-        log_it ("Failed to add new printer queue\n");
-        goto done;
+    ppd_index_tried = TRUE;
+    if (!stat (CUPS_PPD_CACHE, &cache))
+        ppd_index = ppd_index_open (&cache);
+
+    if (!ppd_index) {
+        TraceSpan span;
+        gboolean built;
+
+        trace_begin (&span);
+        built = ppd_index_build ();
+        trace_end (&span, "ppd_index_build");
+
+        if (built && !stat (CUPS_PPD_CACHE, &cache))
+            ppd_index = ppd_index_open (&cache);
     }
-    
-    ret = TRUE;
 
-done:
-    ippDelete (response);
-	return ret;
+    /* a failed build isn't tried again until the cache changes */
+    ppd_index_tried_errno = stat (CUPS_PPD_CACHE, &ppd_index_tried_cache) ? errno : 0;
+    return ppd_index;
 }
 
 /*
- * Remove a printer queue.
+ * Forget the PPD index if the CUPS PPD cache has changed since it was
+ * opened, so that a long running daemon sees newly installed PPDs.
+ * If the index couldn't be had, it's only tried again once the cache
+ * has changed, or appeared or gone away.
  */
-static gboolean remove_print_queue (const char *printer_name)
+static void ppd_index_refresh (void)
 {
-    ipp_t *request, *response;
-    gboolean ret = FALSE;
-	gchar local_uri [HTTP_MAX_URI + 1];
-    
-    request = ippNewRequest (CUPS_DELETE_PRINTER);
-    
-    g_snprintf (local_uri, sizeof local_uri - 1,
-		        "ipp://localhost/printers/%s", printer_name);
-	ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
-		          "printer-uri", NULL, local_uri);
+    struct stat cache;
+    gint err;
+
+    err = stat (CUPS_PPD_CACHE, &cache) ? errno : 0;
+    if (ppd_index && !err &&
+        ppd_index->header->cache_mtime == (gint64) cache.st_mtime &&
+        ppd_index->header->cache_size == (gint64) cache.st_size)
+        return;
+
+    if (!ppd_index && ppd_index_tried && err == ppd_index_tried_errno &&
+        (err || (cache.st_mtime == ppd_index_tried_cache.st_mtime &&
+                 cache.st_size == ppd_index_tried_cache.st_size)))
+        return;
+
+    ppd_index_close ();
+    ppd_index_tried = FALSE;
+}
+
+typedef struct _PPDCandidate {
+    guint32 entry;
+    guint hits;
+} PPDCandidate;
+
+static gint compare_candidates (gconstpointer a, gconstpointer b)
+{
+    const PPDCandidate *c1 = a, *c2 = b;
+
+    if (c1->hits != c2->hits)
+        return c1->hits > c2->hits ? -1 : 1;
+
+    return c1->entry < c2->entry ? -1 : c1->entry > c2->entry;
+}
+
+/*
+ * Count a hit for every PPD with a given token.  Series tokens only
+ * add to the PPDs a model number already picked.
+ */
+static void ppd_index_count_token (PPDIndex *idx, const gchar *make, const gchar *token,
+                                   GHashTable *hits)
+{
+    gchar *key = ppd_index_key ("TK", make, token);
+    const PPDIndexKey *k = ppd_index_lookup (idx, key);
+    gboolean number = g_ascii_isdigit (token[0]);
+    guint32 i;
+
+    g_free (key);
+    if (!k)
+        return;
+
+    for (i = k->first; i < k->first + k->count; i++) {
+        gpointer e = GUINT_TO_POINTER (idx->postings[i] + 1);
+        guint n = GPOINTER_TO_UINT (g_hash_table_lookup (hits, e));
+
+        if (n || number)
+            g_hash_table_insert (hits, e, GUINT_TO_POINTER (n + 1));
+    }
+}
+
+static void add_candidate (gpointer key, gpointer value, gpointer user_data)
+{
+    PPDCandidate c;
+
+    c.entry = GPOINTER_TO_UINT (key) - 1;
+    c.hits = GPOINTER_TO_UINT (value);
+    g_array_append_val ((GArray *) user_data, c);
+}
+
+/*
+ * Check a PPD from the index against a printer the way match_ppds()
+ * would, descriptions and all.
+ */
+static gboolean ppd_index_entry_matches (PPDIndex *idx, const PPDIndexEntry *entry, PrinterInfo *pi)
+{
+    const gchar *id_model = ppd_index_string (idx, entry->id_model);
+    const gchar *model = ppd_index_string (idx, entry->model);
+
+    trace_add (TRACE_PPDS_SCANNED, 1);
+    if (pi->device_id && pi->id.mdl.str && id_model) {
+        IdField ppd_model;
+
+        ppd_model.str = id_model;
+        ppd_model.len = strlen (id_model);
+        return id_field_equal (&ppd_model, &pi->id.mdl) ||
+               match_from_descriptions (pi, &ppd_model, &pi->id.mdl);
+    }
+
+    return model && pi->model && !g_ascii_strcasecmp (model, pi->model);
+}
+
+/*
+ * Find PPDs whose models share tokens with the printer's model and
+ * descriptions, and check the ones sharing the most.  This catches
+ * what match_from_descriptions() does without looking at every PPD.
+ */
+static const PPDIndexEntry *ppd_index_find_fuzzy (PPDIndex *idx, PrinterInfo *pi)
+{
+    const gchar *models[3];
+    const PPDIndexEntry *best = NULL;
+    GPtrArray *tokens;
+    GHashTable *hits;
+    GArray *candidates;
+    gchar *mfg, *make;
+    guint i, pass;
+
+    mfg = id_field_dup (&pi->id.mfg);
+    if (!mfg && !pi->make)
+        return NULL;
+
+    make = normalize_make (mfg ? mfg : pi->make);
+    g_free (mfg);
+
+    /* model numbers can come from anywhere, the series from the model */
+    tokens = g_ptr_array_new ();
+    if (pi->id.mdl.str)
+        model_tokens (pi->id.mdl.str, pi->id.mdl.len, tokens);
+
+    models[0] = pi->model;
+    models[1] = pi->description;
+    models[2] = pi->alt_description;
+    for (i = 0; i < G_N_ELEMENTS (models); i++) {
+        if (models[i])
+            model_tokens (models[i], strlen (models[i]), tokens);
+    }
+
+    g_ptr_array_sort (tokens, compare_strings);
+
+    /* model numbers pick the candidates, then the series add to them */
+    hits = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < tokens->len; i++) {
+            const gchar *token = g_ptr_array_index (tokens, i);
+
+            if ((g_ascii_isdigit (token[0]) ? 0 : 1) != pass ||
+                (i && !strcmp (token, g_ptr_array_index (tokens, i - 1))))
+                continue;
+
+            ppd_index_count_token (idx, make, token, hits);
+        }
+    }
+
+    candidates = g_array_new (FALSE, FALSE, sizeof (PPDCandidate));
+    g_hash_table_foreach (hits, add_candidate, candidates);
+    g_array_sort (candidates, compare_candidates);
+    log_debug ("ppd index has %u candidates for '%s' '%s'\n", candidates->len, make, pi->model);
+
+    for (i = 0; i < candidates->len && i < PPD_INDEX_MAX_CANDIDATES; i++) {
+        guint32 e = g_array_index (candidates, PPDCandidate, i).entry;
+
+        if (e >= idx->header->n_entries || !ppd_index_entry_matches (idx, &idx->entries[e], pi))
+            continue;
+
+        if (!best || idx->entries[e].score > best->score)
+            best = &idx->entries[e];
+
+        if (best->score == PPD_MANUFACTURER)
+            break;
+    }
+
+    g_array_free (candidates, TRUE);
+    g_hash_table_destroy (hits);
+    g_ptr_array_foreach (tokens, (GFunc) g_free, NULL);
+    g_ptr_array_free (tokens, TRUE);
+    g_free (make);
+    return best;
+}
+
+/*
+ * Look up the best PPD for a printer in the PPD index by its 1284
+ * MFG/MDL and by its make and model.  The returned string must be
+ * freed by the caller.
+ */
+static gchar *ppd_index_find (PrinterInfo *pi)
+{
+    PPDIndex *idx = get_ppd_index ();
+    const PPDIndexEntry *best = NULL;
+    gchar *keys[2] = { NULL, NULL };
+    gchar *ret = NULL;
+    gint i;
+
+    if (!idx)
+        return NULL;
+
+    keys[0] = ppd_index_id_key (&pi->id);
+
+    if (pi->make && pi->model) {
+        gchar *nm = normalize_make (pi->make);
+        keys[1] = ppd_index_key ("MM", nm, pi->model);
+        g_free (nm);
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (keys); i++) {
+        const PPDIndexKey *k;
+        guint32 e;
+
+        if (!keys[i] || !(k = ppd_index_lookup (idx, keys[i])))
+            continue;
+
+        e = idx->postings[k->first];
+        if (e >= idx->header->n_entries)
+            continue;
+
+        if (!best || idx->entries[e].score > best->score)
+            best = &idx->entries[e];
+    }
+
+    if (!best)
+        best = ppd_index_find_fuzzy (idx, pi);
+
+    if (best && ppd_index_string (idx, best->name)) {
+        ret = g_strdup (ppd_index_string (idx, best->name));
+        log_it ("ppd index matched '%s'\n", ret);
+    }
+
+    g_free (keys[0]);
+    g_free (keys[1]);
+    return ret;
+}
+
+/*
+ * Rank one PPD from a CUPS_GET_PPDS response for a given printer.
+ * Returns PPD_NO_MATCH if it isn't for the printer.
+ */
+static PPDScore match_ppd (PrinterInfo *pi, const gchar *name, const gchar *make_and_model,
+                           const gchar *id)
+{
+    gchar *ppd_model = NULL;
+    gboolean match = FALSE;
+
+    if (pi->device_id && id && strlen (id)) {
+        const IdField *pm = &pi->id.mdl;
+        DeviceId ppd_id;
+
+        /* match with ieee 1284 ids */
+        log_debug ("Matching with 1284 ids:\n\t'%s'\n\t'%s'\n", pi->device_id, id);
+        parse_1284_id (id, &ppd_id);
+        log_debug ("Extracted models are '%.*s' (printer) and '%.*s' (ppd)\n",
+                    (int) pm->len, pm->str, (int) ppd_id.mdl.len, ppd_id.mdl.str);
+        if (!ppd_id.mdl.str || !pm->str)
+            return PPD_NO_MATCH;
+
+        match = id_field_equal (&ppd_id.mdl, pm);
+        if (!match)
+            match = match_from_descriptions (pi, &ppd_id.mdl, pm);
+
+        log_debug ("Result for matching '%.*s' and '%.*s' was %d\n\n", (int) ppd_id.mdl.len,
+                    ppd_id.mdl.str, (int) pm->len, pm->str, match);
+    } else {
+        /* match with model strings */
+        log_debug ("Matching with model strings '%s' and '%s'\n", pi->model, make_and_model);
+        ppd_model = model_from_string (pi->make, make_and_model);
+        log_debug ("Extracted model string from ppd was '%s'\n", ppd_model);
+        if (!ppd_model)
+            return PPD_NO_MATCH;
+
+        match = !g_ascii_strcasecmp (ppd_model, pi->model) ? TRUE : FALSE;
+        log_debug ("Result for matching '%s' and '%s' was %d\n\n", ppd_model, pi->model, match);
+        g_free (ppd_model);
+    }
+
+    return match ? get_ppd_score (name, make_and_model) : PPD_NO_MATCH;
+}
+
+/*
+ * Printers that are being matched against one list of PPDs, and the
+ * best PPD each has so far.  If a printer's make is known the PPDs of
+ * that make win over the rest, the way get_best_ppd() only asks for
+ * all the PPDs if none of its make's matched.
+ */
+typedef struct _PPDMatch {
+    PrinterInfo *pi;
+    gchar *make;
+    gchar *make_ppd;
+    PPDScore make_score;
+    gchar *ppd;
+    PPDScore score;
+} PPDMatch;
+
+static void ppd_match_free (PPDMatch *m)
+{
+    g_free (m->make);
+    g_free (m->make_ppd);
+    g_free (m->ppd);
+}
+
+/*
+ * The best PPD for a matched printer.  The returned string must be
+ * freed by the caller.
+ */
+static gchar *ppd_match_steal (PPDMatch *m)
+{
+    gchar **best = m->make_ppd ? &m->make_ppd : &m->ppd;
+    gchar *ret = *best;
+
+    *best = NULL;
+    return ret;
+}
+
+static gboolean ppd_match_done (PPDMatch *m)
+{
+    return m->make ? m->make_score == PPD_MANUFACTURER : m->score == PPD_MANUFACTURER;
+}
+
+/*
+ * Match one PPD from a CUPS_GET_PPDS response against the printers.
+ * Returns TRUE once none of them can do any better, so the rest of
+ * the PPDs don't need to be looked at.
+ */
+static gboolean ppd_match_add (PPDMatch *matches, guint n, const gchar *name, const gchar *make,
+                               const gchar *make_and_model, const gchar *id)
+{
+    gboolean done = TRUE;
+    guint i;
+
+    trace_add (TRACE_PPDS_SCANNED, 1);
+    for (i = 0; i < n; i++) {
+        PPDMatch *m = &matches[i];
+        PPDScore score;
+
+        if (ppd_match_done (m))
+            continue;
+
+        score = match_ppd (m->pi, name, make_and_model, id);
+        if (score > m->score) {
+            g_free (m->ppd);
+            m->ppd = g_strdup (name);
+            m->score = score;
+        }
+
+        if (m->make && make && score > m->make_score && !g_ascii_strcasecmp (m->make, make)) {
+            g_free (m->make_ppd);
+            m->make_ppd = g_strdup (name);
+            m->make_score = score;
+        }
+
+        done = done && ppd_match_done (m);
+    }
+
+    return done;
+}
+
+/*
+ * Match the PPDs in a CUPS_GET_PPDS response against the printers.
+ * 
+ * Look for ppds that match our model with priority: 
+ * manufacturer-PPD > recommended > simple match
+ */
+static void match_ppds (ipp_t *response, PPDMatch *matches, guint n)
+{
+    ipp_attribute_t *attr;
+
+    for (attr = response->attrs; attr; attr = attr ? attr->next : NULL) {
+        const gchar *name = NULL, *make = NULL, *make_and_model = NULL, *id = NULL;
+        
+        while (attr && attr->group_tag != IPP_TAG_PRINTER)
+            attr = attr->next;
+
+        if (!attr)
+            return;
+
+        for (; attr && attr->group_tag == IPP_TAG_PRINTER; attr = attr->next) {
+            if (!strcmp (attr->name, "ppd-name") && attr->value_tag == IPP_TAG_NAME) {
+                name = attr->values[0].string.text;
+            } else if (!strcmp (attr->name, "ppd-make") && attr->value_tag == IPP_TAG_TEXT) {
+                make = attr->values[0].string.text;
+            } else if (!strcmp (attr->name, "ppd-make-and-model") && attr->value_tag == IPP_TAG_TEXT) {
+                make_and_model = attr->values[0].string.text;
+            } else if (!strcmp (attr->name, "ppd-device-id") && attr->value_tag == IPP_TAG_TEXT) {
+                id = attr->values[0].string.text;
+            } 
+        }
+
+        if (ppd_match_add (matches, n, name, make, make_and_model, id))
+            return;
+    }
+}
+
+/*
+ * A CUPS_GET_PPDS response that is read off the connection as it
+ * arrives, so each PPD can be looked at without waiting for, or
+ * keeping, the rest.  The PPD being read is in name, make,
+ * make_and_model and id.
+ */
+typedef struct _PPDStream {
+    http_t *http;
+    guchar buf[PPD_STREAM_BUFFER];
+    gsize pos;
+    gsize len;
+    GString *name;
+    GString *make;
+    GString *make_and_model;
+    GString *id;
+} PPDStream;
+
+/*
+ * Make sure there are at least n unread bytes in the buffer.
+ */
+static gboolean ppd_stream_fill (PPDStream *st, gsize n)
+{
+    if (st->len - st->pos >= n)
+        return TRUE;
+
+    if (n > sizeof (st->buf))
+        return FALSE;
+
+    memmove (st->buf, st->buf + st->pos, st->len - st->pos);
+    st->len -= st->pos;
+    st->pos = 0;
+
+    while (st->len < n) {
+        gint got = httpRead (st->http, (gchar *) st->buf + st->len, sizeof (st->buf) - st->len);
+
+        if (got <= 0)
+            return FALSE;
+
+        st->len += got;
+        trace_add (TRACE_BYTES_RECEIVED, got);
+    }
+
+    return TRUE;
+}
+
+/*
+ * Skip n bytes, which don't need to fit in the buffer.
+ */
+static gboolean ppd_stream_skip (PPDStream *st, gsize n)
+{
+    while (n > 0) {
+        gsize avail;
+
+        if (!ppd_stream_fill (st, 1))
+            return FALSE;
+
+        avail = MIN (n, st->len - st->pos);
+        st->pos += avail;
+        n -= avail;
+    }
+
+    return TRUE;
+}
+
+static guint ppd_stream_short (PPDStream *st)
+{
+    guint ret = (st->buf[st->pos] << 8) | st->buf[st->pos + 1];
+
+    st->pos += 2;
+    return ret;
+}
+
+/*
+ * Read the next attribute of the response.  Only the first value of
+ * the attributes we look at is kept, in the PPD's strings.  Names and
+ * values too long for the buffer are skipped.  Returns the tag that
+ * was read, which is IPP_TAG_END at the end of the response, or
+ * IPP_TAG_ZERO if the response couldn't be read.
+ */
+static ipp_tag_t ppd_stream_read (PPDStream *st, ipp_tag_t group)
+{
+    GString *value = NULL;
+    ipp_tag_t tag;
+    guint len;
+
+    if (!ppd_stream_fill (st, 1))
+        return IPP_TAG_ZERO;
+
+    tag = st->buf[st->pos++];
+    if (tag < IPP_TAG_UNSUPPORTED_VALUE)
+        return tag;
+
+    /* the real tag follows in the next four bytes */
+    if (tag == IPP_TAG_EXTENSION) {
+        if (!ppd_stream_fill (st, 4))
+            return IPP_TAG_ZERO;
+
+        tag = (st->buf[st->pos] << 24) | (st->buf[st->pos + 1] << 16) |
+              (st->buf[st->pos + 2] << 8) | st->buf[st->pos + 3];
+        st->pos += 4;
+    }
+
+    if (!ppd_stream_fill (st, 2))
+        return IPP_TAG_ZERO;
+
+    /* a name of length 0 is another value of the last attribute */
+    len = ppd_stream_short (st);
+    if (len + 2 > sizeof (st->buf)) {
+        if (!ppd_stream_skip (st, len) || !ppd_stream_fill (st, 2))
+            return IPP_TAG_ZERO;
+    } else if (!ppd_stream_fill (st, len + 2)) {
+        return IPP_TAG_ZERO;
+    } else if (len && group == IPP_TAG_PRINTER) {
+        const gchar *name = (const gchar *) st->buf + st->pos;
+
+        if (tag == IPP_TAG_NAME && len == 8 && !strncmp (name, "ppd-name", len))
+            value = st->name;
+        else if (tag == IPP_TAG_TEXT && len == 8 && !strncmp (name, "ppd-make", len))
+            value = st->make;
+        else if (tag == IPP_TAG_TEXT && len == 18 && !strncmp (name, "ppd-make-and-model", len))
+            value = st->make_and_model;
+        else if (tag == IPP_TAG_TEXT && len == 13 && !strncmp (name, "ppd-device-id", len))
+            value = st->id;
+    }
+
+    if (len + 2 <= sizeof (st->buf))
+        st->pos += len;
+
+    len = ppd_stream_short (st);
+    if (len > sizeof (st->buf))
+        return ppd_stream_skip (st, len) ? tag : IPP_TAG_ZERO;
+
+    if (!ppd_stream_fill (st, len))
+        return IPP_TAG_ZERO;
+
+    if (value) {
+        g_string_truncate (value, 0);
+        g_string_append_len (value, (const gchar *) st->buf + st->pos, len);
+    }
+
+    st->pos += len;
+    return tag;
+}
+
+/*
+ * Ask cupsd for its PPDs and match them against the printers as they
+ * come in, keeping only the best so far.  The transfer is stopped as
+ * soon as none of the printers can do better, which is usually long
+ * before the end of the list.  Returns FALSE if the response couldn't
+ * be read this way, e.g. because cupsd wants us to authenticate or the
+ * connection dropped, in which case the request is left for
+ * cups_do_request().  The PPDs matched before a dropped connection are
+ * looked at again then, which doesn't change the best ones.
+ */
+static gboolean stream_ppds (ipp_t *request, PPDMatch *matches, guint n)
+{
+    PPDStream *st;
+    ipp_tag_t tag, group = IPP_TAG_ZERO;
+    http_status_t hstatus;
+    TraceSpan span;
+    gboolean ret = FALSE, done = FALSE;
+    guint status;
+
+    trace_begin (&span);
+    st = g_new0 (PPDStream, 1);
+    st->http = httpConnectEncrypt (cupsServer (), ippPort (), cupsEncryption ());
+    if (!st->http || !cups_send_request (st->http, request))
+        goto done;
+
+    while ((hstatus = httpUpdate (st->http)) == HTTP_CONTINUE);
+
+    if (hstatus != HTTP_OK) {
+        log_debug ("cupsd answered with HTTP status %d, not streaming ppds\n", hstatus);
+        goto done;
+    }
+
+    /* version, status and request id */
+    if (!ppd_stream_fill (st, 8))
+        goto done;
+
+    status = (st->buf[2] << 8) | st->buf[3];
+    st->pos = 8;
+
+    if (status > IPP_OK_CONFLICT) {
+        log_error ("Failed to get ppds (status %04x)\n", status);
+        ret = TRUE;
+        goto done;
+    }
+
+    st->name = g_string_new (NULL);
+    st->make = g_string_new (NULL);
+    st->make_and_model = g_string_new (NULL);
+    st->id = g_string_new (NULL);
+
+    do {
+        tag = ppd_stream_read (st, group);
+        if (tag == IPP_TAG_ZERO) {
+            log_error ("Failed to read the list of ppds from cupsd, asking again\n");
+            break;
+        }
+
+        if (tag >= IPP_TAG_UNSUPPORTED_VALUE)
+            continue;
+
+        /* a delimiter, so the last PPD is all there */
+        if (group == IPP_TAG_PRINTER && st->name->len)
+            done = ppd_match_add (matches, n, st->name->str,
+                                  st->make->len ? st->make->str : NULL,
+                                  st->make_and_model->len ? st->make_and_model->str : NULL,
+                                  st->id->str);
+
+        g_string_truncate (st->name, 0);
+        g_string_truncate (st->make, 0);
+        g_string_truncate (st->make_and_model, 0);
+        g_string_truncate (st->id, 0);
+        group = tag;
+    } while (tag != IPP_TAG_END && !done);
+
+    if (tag != IPP_TAG_END && done)
+        log_debug ("Found the best ppds, not reading the rest of the list\n");
+
+    ret = tag == IPP_TAG_END || done;
+
+done:
+    /* closing the connection is what stops cupsd sending the rest */
+    if (st->http)
+        httpClose (st->http);
+    if (st->name) {
+        g_string_free (st->name, TRUE);
+        g_string_free (st->make, TRUE);
+        g_string_free (st->make_and_model, TRUE);
+        g_string_free (st->id, TRUE);
+    }
+    g_free (st);
+    trace_end (&span, "stream_ppds");
+    return ret;
+}
+
+/*
+ * Match the PPDs cupsd has against the printers, only looking at the
+ * ones that match make or device_id if they're given.
+ */
+static void find_ppds (PPDMatch *matches, guint n, const gchar *make, const gchar *device_id)
+{
+    ipp_t *request, *response;
+
+    request = new_get_ppds_request (make, device_id);
+    if (stream_ppds (request, matches, n)) {
+        ippDelete (request);
+        return;
+    }
+
+    response = cups_do_request (request, "get_ppds");
+    if (!response || response->request.status.status_code > IPP_OK_CONFLICT) {
+        log_error ("Failed to get ppds (make='%s' device-id='%s')\n", make, device_id);
+        ippDelete (response);
+        return;
+    }
+
+    match_ppds (response, matches, n);
+    ippDelete (response);
+}
+
+/*
+ * Find the best of the PPDs cupsd has for a printer, see find_ppds().
+ * The returned string must be freed by the caller.
+ */
+static gchar *find_ppd (PrinterInfo *pi, const gchar *make, const gchar *device_id)
+{
+    PPDMatch m = { pi };
+    gchar *ppd;
+
+    find_ppds (&m, 1, make, device_id);
+    ppd = ppd_match_steal (&m);
+    ppd_match_free (&m);
+    return ppd;
+}
+
+/*
+ * The make to prefer the PPDs of for a printer, or NULL if it isn't
+ * known.  The returned string must be freed by the caller.
+ */
+static gchar *get_ppd_make (PrinterInfo *pi)
+{
+    gchar *make = id_field_dup (&pi->id.mfg), *nm = NULL;
+
+    if (make || pi->make)
+        nm = normalize_make (make ? make : pi->make);
+
+    g_free (make);
+    return nm;
+}
+
+/*
+ * Return the best PPD file to use for a given printer.  The
+ * returned string must be freed by the caller.
+ */
+static gchar *get_best_ppd (PrinterInfo *pi)
+{
+    gchar *ppd, *nm;
+
+    /* a hash probe is all we need if the printer is in the index */
+    ppd = ppd_index_find (pi);
+    if (ppd)
+        return ppd;
+
+    /* only ask for this printer's make's ppds if we know the make */
+    nm = get_ppd_make (pi);
+
+    if (nm) {
+        ppd = find_ppd (pi, nm, NULL);
+        if (!ppd)
+            log_it ("No '%s' ppd matched, checking all ppds\n", nm);
+
+        g_free (nm);
+    } else if (pi->device_id) {
+        ppd = find_ppd (pi, NULL, pi->device_id);
+    }
+
+    if (ppd)
+        return ppd;
+
+    return find_ppd (pi, NULL, NULL);
+}
+
+/*
+ * Find the best PPD files for a number of printers, e.g. all those
+ * that are plugged in at boot.  The ones that aren't in the PPD index
+ * are matched in one pass over all the PPDs cupsd has, rather than
+ * with up to two requests each.  NULL printers are skipped.  The
+ * returned strings must be freed by the caller.
+ */
+static void get_best_ppds (PrinterInfo **printers, guint n, gchar **ppds)
+{
+    GArray *pending = g_array_new (FALSE, TRUE, sizeof (PPDMatch));
+    guint *index = g_new (guint, n);
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        PPDMatch m = { printers[i] };
+
+        if (!printers[i] || (ppds[i] = ppd_index_find (printers[i])))
+            continue;
+
+        m.make = get_ppd_make (printers[i]);
+        index[pending->len] = i;
+        g_array_append_val (pending, m);
+    }
+
+    /* one printer is cheaper to match with the requests for its make */
+    if (pending->len == 1) {
+        PPDMatch *m = &g_array_index (pending, PPDMatch, 0);
+        ppds[index[0]] = get_best_ppd (m->pi);
+    } else if (pending->len > 1) {
+        log_it ("Matching %d printers against all ppds\n", pending->len);
+        find_ppds ((PPDMatch *) pending->data, pending->len, NULL, NULL);
+    }
+
+    for (i = 0; i < pending->len; i++) {
+        PPDMatch *m = &g_array_index (pending, PPDMatch, i);
+
+        if (pending->len > 1)
+            ppds[index[i]] = ppd_match_steal (m);
+        ppd_match_free (m);
+    }
+
+    g_array_free (pending, TRUE);
+    g_free (index);
+}
+
+/*
+ * A cups backend that is being run to list its printers.
+ */
+typedef struct _BackendProbe {
+    const gchar *name;
+    GPid pid;
+    gint fd;
+    GString *buf;
+    gsize scanned;
+    GSList *printers;
+    gboolean exited;
+    gboolean ok;
+    gboolean timed_out;
+} BackendProbe;
+
+/*
+ * Split the next field off a line of backend output.  Quoted fields
+ * can have quotes in them if they're escaped with a backslash.
+ * Returns FALSE if there are no more fields, or if a quoted field
+ * isn't closed.
+ */
+static gboolean next_backend_field (const gchar **p, const gchar *end, gboolean quoted, IdField *f)
+{
+    const gchar *s = *p;
+
+    while (s < end && g_ascii_isspace (*s))
+        s++;
+
+    if (s == end)
+        return FALSE;
+
+    if (!quoted) {
+        f->str = s;
+        while (s < end && !g_ascii_isspace (*s))
+            s++;
+
+        f->len = s - f->str;
+        *p = s;
+        return TRUE;
+    }
+
+    if (*s != '"')
+        return FALSE;
+
+    f->str = ++s;
+    s = memchr (f->str, '"', end - f->str);
+    if (!s)
+        return FALSE;
+
+    /* only walk the field if it has escapes in it */
+    if (memchr (f->str, '\\', s - f->str)) {
+        for (s = f->str; s < end && *s != '"'; s++) {
+            if (*s == '\\' && s + 1 < end)
+                s++;
+        }
+
+        if (s == end)
+            return FALSE;
+    }
+
+    f->len = s - f->str;
+    *p = s + 1;
+    return TRUE;
+}
+
+/*
+ * Split a line of backend output, which doesn't need to be NUL
+ * terminated, into its fields.  Returns FALSE if the line doesn't
+ * have at least a class, a uri and a make and model.
+ */
+static gboolean parse_backend_device (const gchar *line, gsize len, BackendDevice *dev)
+{
+    const gchar *p = line, *end = line + len;
+
+    memset (dev, 0, sizeof (*dev));
+    if (!next_backend_field (&p, end, FALSE, &dev->dclass) ||
+        !next_backend_field (&p, end, FALSE, &dev->uri) ||
+        !next_backend_field (&p, end, TRUE, &dev->make_and_model))
+        return FALSE;
+
+    /* the rest are optional */
+    if (next_backend_field (&p, end, TRUE, &dev->info) &&
+        next_backend_field (&p, end, TRUE, &dev->device_id))
+        next_backend_field (&p, end, TRUE, &dev->location);
+
+    return TRUE;
+}
+
+/*
+ * Copy a quoted field of backend output into the arena, without its
+ * backslash escapes.
+ */
+static gchar *arena_unquote (const IdField *f)
+{
+    gchar *ret, *q;
+    gsize i;
+
+    ret = arena_strndup (f->str, f->len);
+    if (!memchr (f->str, '\\', f->len))
+        return ret;
+
+    for (i = 0, q = ret; i < f->len; i++) {
+        if (f->str[i] == '\\' && i + 1 < f->len)
+            i++;
+        *q++ = f->str[i];
+    }
+
+    *q = '\0';
+    return ret;
+}
+
+/*
+ * Parse a line of backend output.  Returns NULL if the line isn't a
+ * local printer for this backend.
+ */
+static PrinterInfo *parse_backend_line (const gchar *backend, const gchar *line, gsize len)
+{
+    PrinterInfo *pi;
+    BackendDevice dev;
+    gsize n = strlen (backend);
+
+    if (!parse_backend_device (line, len, &dev))
+        return NULL;
+
+    /* all local printers have direct as their class */
+    if (!id_field_equal_str (&dev.dclass, "direct"))
+        return NULL;
+
+    /* make sure it's a valid uri for this backend */
+    if (dev.uri.len < n + 2 || strncmp (dev.uri.str, backend, n) ||
+        strncmp (dev.uri.str + n, ":/", 2))
+        return NULL;
+
+    pi = arena_alloc0 (sizeof (PrinterInfo));
+    pi->uri = arena_strndup (dev.uri.str, dev.uri.len);
+    pi->make_and_model = arena_unquote (&dev.make_and_model);
+
+    if (dev.device_id.len) {
+        pi->device_id = arena_unquote (&dev.device_id);
+        parse_1284_id (pi->device_id, &pi->id);
+    }
+
+    return pi;
+}
+
+/*
+ * Put a backend in a process group of its own, so the helpers it
+ * starts can be stopped along with it.
+ */
+static void backend_child_setup (gpointer data)
+{
+    setpgid (0, 0);
+}
+
+/*
+ * Start a cups backend with its stdout connected to a pipe.
+ */
+static gboolean start_backend (BackendProbe *probe)
+{
+    gchar *path = g_build_path ("/", CUPS_BACKEND_DIR, probe->name, NULL);
+    gchar *argv[] = { path, NULL };
+    GError *err = NULL;
+    gboolean ret;
+
+    probe->fd = -1;
+    probe->exited = FALSE;
+    trace_add (TRACE_BACKEND_SPAWNS, 1);
+    ret = g_spawn_async_with_pipes (NULL, argv, NULL,
+                                    G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDERR_TO_DEV_NULL,
+                                    backend_child_setup, NULL, &probe->pid, NULL, &probe->fd,
+                                    NULL, &err);
+    if (!ret) {
+        log_error ("%s\n", err->message);
+        g_error_free (err);
+        probe->pid = 0;
+    } else {
+        fcntl (probe->fd, F_SETFL, fcntl (probe->fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    g_free (path);
+    return ret;
+}
+
+/*
+ * Parse the complete lines a backend has written so far, or everything
+ * that's left once it has closed its stdout.  A line can be any length,
+ * the part of it that has been read is kept in the buffer until the
+ * rest arrives.
+ */
+static void parse_backend_output (BackendProbe *probe, gboolean eof)
+{
+    const gchar *line = probe->buf->str, *end = probe->buf->str + probe->buf->len;
+
+    while (line < end) {
+        /* don't look for the newline in what was searched last time */
+        const gchar *from = MAX (line, probe->buf->str + probe->scanned);
+        const gchar *nl = memchr (from, '\n', end - from);
+        PrinterInfo *pi;
+
+        if (!nl && !eof)
+            break;
+
+        pi = parse_backend_line (probe->name, line, (nl ? nl : end) - line);
+        if (pi) {
+            probe->printers = g_slist_prepend (probe->printers, pi);
+            log_it ("local printer '%s' - '%s'\n", pi->uri, pi->make_and_model);
+        }
+
+        line = nl ? nl + 1 : end;
+    }
+
+    g_string_erase (probe->buf, 0, line - probe->buf->str);
+    probe->scanned = probe->buf->len;
+}
+
+/*
+ * Remember a child we stopped waiting for, so it can be reaped once
+ * it exits instead of staying a zombie.
+ */
+static void leave_child (GPid pid)
+{
+    if (!stray_children)
+        stray_children = g_array_new (FALSE, FALSE, sizeof (GPid));
+
+    g_array_append_val (stray_children, pid);
+}
+
+/*
+ * Reap the children left behind earlier that have exited since.
+ */
+static void reap_stray_children (void)
+{
+    guint i;
+
+    for (i = stray_children ? stray_children->len : 0; i > 0; i--) {
+        GPid pid = g_array_index (stray_children, GPid, i - 1);
+
+        if (waitpid (pid, NULL, WNOHANG) != 0) {
+            log_debug ("Reaped child %d\n", (gint) pid);
+            g_array_remove_index_fast (stray_children, i - 1);
+        }
+    }
+}
+
+/*
+ * Reap a backend if it has exited.  Returns TRUE once the backend has
+ * exited and closed its stdout.
+ */
+static gboolean reap_backend (BackendProbe *probe, gint64 start)
+{
+    gint status;
+    pid_t ret;
+
+    if (probe->pid && !probe->exited) {
+        ret = waitpid (probe->pid, &status, WNOHANG);
+        if (ret != 0 && !(ret < 0 && errno == EINTR)) {
+            probe->exited = TRUE;
+            probe->ok = ret == probe->pid && WIFEXITED (status) && WEXITSTATUS (status) == 0;
+            log_it ("'%s' backend took %d ms\n", probe->name,
+                    (gint) ((get_time_us () - start) / 1000));
+        }
+    }
+
+    return (!probe->pid || probe->exited) && probe->fd == -1;
+}
+
+/*
+ * Send a signal to the backends that are still running.
+ */
+static void signal_backends (BackendProbe *probes, gint n, gint sig, gint64 start)
+{
+    gint i;
+
+    for (i = 0; i < n; i++) {
+        if (!probes[i].pid || (probes[i].exited && probes[i].fd == -1))
+            continue;
+
+        if (sig == SIGTERM) {
+            log_error ("'%s' backend timed out after %d ms, stopping it\n", probes[i].name,
+                       (gint) ((get_time_us () - start) / 1000));
+            probes[i].timed_out = TRUE;
+        } else {
+            log_error ("'%s' backend didn't stop, killing it\n", probes[i].name);
+        }
+
+        kill (-probes[i].pid, sig);
+    }
+}
+
+/*
+ * Run a set of cups backends at the same time and collect the printers
+ * each of them detects.  probe->ok is set if the backend exited cleanly.
+ * Backends that are still running after the device timeout are sent
+ * SIGTERM, and SIGKILL BACKEND_KILL_TIMEOUT ms later.  probe->timed_out
+ * is set for them, and the printers they listed in time are kept.
+ */
+static void run_backends (BackendProbe *probes, gint n)
+{
+    struct pollfd *fds = g_new (struct pollfd, n);
+    gint *fd_probe = g_new (gint, n);
+    gint64 start = get_time_us (), next = G_MAXINT64;
+    gint i, sig = SIGTERM;
+    gchar buff[4096];
+
+    if (config->device_timeout > 0)
+        next = start + (gint64) config->device_timeout * G_USEC_PER_SEC;
+
+    reap_stray_children ();
+    for (i = 0; i < n; i++) {
+        probes[i].buf = g_string_new (NULL);
+        probes[i].scanned = 0;
+        probes[i].printers = NULL;
+        probes[i].ok = FALSE;
+        probes[i].timed_out = FALSE;
+
+        start_backend (&probes[i]);
+    }
+
+    /* a backend is done once it has closed its stdout and exited */
+    for (;;) {
+        gint nfds = 0, exiting = 0, timeout = -1, ready;
+        gint64 now;
+
+        for (i = 0; i < n; i++) {
+            if (reap_backend (&probes[i], start))
+                continue;
+
+            if (probes[i].fd == -1) {
+                exiting++;
+                continue;
+            }
+
+            fds[nfds].fd = probes[i].fd;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            fd_probe[nfds++] = i;
+        }
+
+        if (!nfds && !exiting)
+            break;
+
+        now = get_time_us ();
+        if (now >= next) {
+            /* after SIGKILL, give the kernel a moment before giving up */
+            if (!sig)
+                break;
+
+            signal_backends (probes, n, sig, start);
+            next = now + BACKEND_KILL_TIMEOUT * 1000;
+            sig = sig == SIGTERM ? SIGKILL : 0;
+            continue;
+        }
+
+        if (next != G_MAXINT64)
+            timeout = (next - now + 999) / 1000;
+
+        /* nothing tells us when a backend exits, so check now and then */
+        if (exiting && (timeout < 0 || timeout > BACKEND_REAP_INTERVAL))
+            timeout = BACKEND_REAP_INTERVAL;
+
+        ready = poll (fds, nfds, timeout);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+
+            log_error ("poll failed: %s\n", strerror (errno));
+            break;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            BackendProbe *probe = &probes[fd_probe[i]];
+            gssize len;
+
+            if (!fds[i].revents)
+                continue;
+
+            len = read (probe->fd, buff, sizeof (buff));
+            if (len < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+
+            if (len > 0) {
+                g_string_append_len (probe->buf, buff, len);
+                parse_backend_output (probe, FALSE);
+                continue;
+            }
+
+            /* the backend closed its stdout, maybe because it was killed */
+            parse_backend_output (probe, !probe->timed_out);
+            close (probe->fd);
+            probe->fd = -1;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        BackendProbe *probe = &probes[i];
+
+        /* the partial line of a backend that was killed is dropped */
+        if (probe->fd != -1)
+            close (probe->fd);
+
+        /*
+         * A backend stuck in the kernel on a wedged device can't be
+         * reaped until it comes back, so it's reaped on a later pass.
+         */
+        if (probe->pid && !probe->exited) {
+            log_error ("'%s' backend is still running, not waiting for it\n", probe->name);
+            leave_child (probe->pid);
+        } else if (probe->pid) {
+            g_spawn_close_pid (probe->pid);
+        }
+
+        probe->printers = g_slist_reverse (probe->printers);
+        g_string_free (probe->buf, TRUE);
+    }
+
+    g_free (fd_probe);
+    g_free (fds);
+}
+
+/*
+ * Find the probe for the backend a device uri belongs to.
+ */
+static BackendProbe *find_probe_for_uri (BackendProbe *probes, gint n, const gchar *uri)
+{
+    gint i;
+
+    for (i = 0; i < n; i++) {
+        gsize len = strlen (probes[i].name);
+        if (!strncmp (uri, probes[i].name, len) && !strncmp (uri + len, ":/", 2))
+            return &probes[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Have cupsd run the backends for us with CUPS-Get-Devices, limited
+ * to the schemes of the probes.  cupsd runs the backends in parallel
+ * and gives up on them after the device timeout.  Returns FALSE if
+ * cupsd couldn't be asked, in which case we run the backends ourselves.
+ */
+static gboolean get_cups_devices (BackendProbe *probes, gint n)
+{
+    static const char * const attrs[] = {
+        "device-class", "device-uri", "device-make-and-model", "device-id"
+    };
+    ipp_t *request, *response;
+    ipp_attribute_t *attr;
+    const gchar **schemes;
+    gint i;
+
+    schemes = g_new (const gchar *, n);
+    for (i = 0; i < n; i++) {
+        schemes[i] = probes[i].name;
+        probes[i].printers = NULL;
+        probes[i].ok = FALSE;
+    }
+
+    request = ippNewRequest (CUPS_GET_DEVICES);
+    ippAddStrings (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "requested-attributes",
+                   G_N_ELEMENTS (attrs), NULL, attrs);
+    ippAddStrings (request, IPP_TAG_OPERATION, IPP_TAG_NAME, "include-schemes",
+                   n, NULL, schemes);
+    if (config->device_timeout > 0)
+        ippAddInteger (request, IPP_TAG_OPERATION, IPP_TAG_INTEGER, "timeout",
+                       config->device_timeout);
+    g_free (schemes);
+
+    response = cups_do_request (request, "get_cups_devices");
+    if (!response || response->request.status.status_code > IPP_OK_CONFLICT) {
+        log_error ("Failed to get the list of devices from cupsd\n");
+        ippDelete (response);
+        return FALSE;
+    }
+
+    for (attr = response->attrs; attr; attr = attr->next) {
+        const gchar *dclass = NULL, *uri = NULL, *mm = NULL, *id = NULL;
+        BackendProbe *probe;
+        PrinterInfo *pi;
+
+        while (attr && attr->group_tag != IPP_TAG_PRINTER)
+            attr = attr->next;
+
+        if (!attr)
+            break;
+
+        for (; attr && attr->group_tag == IPP_TAG_PRINTER; attr = attr->next) {
+            if (!strcmp (attr->name, "device-class"))
+                dclass = attr->values[0].string.text;
+            else if (!strcmp (attr->name, "device-uri"))
+                uri = attr->values[0].string.text;
+            else if (!strcmp (attr->name, "device-make-and-model"))
+                mm = attr->values[0].string.text;
+            else if (!strcmp (attr->name, "device-id"))
+                id = attr->values[0].string.text;
+        }
+
+        /* older cupsds ignore include-schemes, so check it here too */
+        if (dclass && uri && mm && !strcmp (dclass, "direct") &&
+            (probe = find_probe_for_uri (probes, n, uri))) {
+            pi = arena_alloc0 (sizeof (PrinterInfo));
+            pi->uri = arena_strdup (uri);
+            pi->make_and_model = arena_strdup (mm);
+            if (id && *id) {
+                pi->device_id = arena_strdup (id);
+                parse_1284_id (pi->device_id, &pi->id);
+            }
+
+            probe->printers = g_slist_prepend (probe->printers, pi);
+            log_it ("local printer '%s' - '%s'\n", pi->uri, pi->make_and_model);
+        }
+
+        if (!attr)
+            break;
+    }
+
+    /* cupsd doesn't tell us which backends failed */
+    for (i = 0; i < n; i++) {
+        probes[i].printers = g_slist_reverse (probes[i].printers);
+        probes[i].ok = TRUE;
+    }
+
+    ippDelete (response);
+    return TRUE;
+}
+
+/*
+ * See if a usb backend printer was also detected by a preferred backend.
+ * The match is removed from the backend's list and returned.
+ */
+static PrinterInfo *find_preferred_backend_match (PrinterInfo *usbp, GSList **detected)
+{
+    GSList *p;
+
+    for (p = *detected; p; p = p->next) {
+        PrinterInfo *sp = p->data;
+        gchar *s1, *s2;
+
+        if (usbp->device_id && sp->device_id) {
+            /* match by ieee1284 ids */
+            if (!match_by_1284 (&sp->id, &usbp->id))
+                continue;
+
+            if (sp->id.des.str)
+                sp->description = arena_strndup (sp->id.des.str, sp->id.des.len);
+            if (usbp->id.des.str)
+                sp->alt_description = arena_strndup (usbp->id.des.str, usbp->id.des.len);
+        } else {
+            /* match by make and model */
+            if (g_ascii_strcasecmp (usbp->make_and_model, sp->make_and_model))
+                continue;
+
+            s1 = strstr (usbp->uri, "?serial=");
+            s2 = strstr (sp->uri, "?serial=");
+
+            /* check the serial numbers if both printers have them */
+            if (s1 && s2 && g_ascii_strcasecmp (s1 + 8, s2 + 8))
+                continue;
+        }
+
+        *detected = g_slist_delete_link (*detected, p);
+        return sp;
+    }
+
+    return NULL;
+}
+
+/*
+ * Run the cups backends to find the printers they detect.  The usb
+ * backend and the preferred backends are all run at once, by cupsd
+ * if it can, or by us if it can't.  complete is set to FALSE if a
+ * backend timed out and only the printers it listed in time are known.
+ */
+static gboolean probe_detected_printers (GSList **list, gboolean *complete)
+{
+    BackendProbe probes[] = { { "usb" }, { "hp" }, { "epson" }, { "canon" } };
+    TraceSpan span;
+    GSList *p;
+    int i;
+
+    if (!config->cups_devices || !get_cups_devices (probes, G_N_ELEMENTS (probes))) {
+        trace_begin (&span);
+        run_backends (probes, G_N_ELEMENTS (probes));
+        trace_end (&span, "run_backends");
+    }
+
+    *complete = TRUE;
+    for (i = 0; i < G_N_ELEMENTS (probes); i++) {
+        if (!probes[i].timed_out)
+            continue;
+
+        log_it ("keeping %u printers from '%s' backend\n",
+                g_slist_length (probes[i].printers), probes[i].name);
+        probes[i].ok = TRUE;
+        *complete = FALSE;
+    }
+
+    for (i = 1; i < G_N_ELEMENTS (probes); i++) {
+        if (probes[i].ok)
+            continue;
+
+        log_error ("Failed to list printers from '%s' backend\n", probes[i].name);
+        g_slist_free (probes[i].printers);
+        probes[i].printers = NULL;
+    }
+
+    if (!probes[0].ok) {
+        log_error ("Failed to get printers from usb backend\n");
+        for (i = 0; i < G_N_ELEMENTS (probes); i++) {
+            g_slist_free (probes[i].printers);
+        }
+        return FALSE;
+    }
+
+    /* 
+     * See if the detected usb printers match one of printers
+     * detected by the preferred backends.
+     */
+    for (p = probes[0].printers; p; p = p->next) {
+        PrinterInfo *match = NULL, *pi = p->data;
+
+        for (i = 1; i < G_N_ELEMENTS (probes); i++) {
+            match = find_preferred_backend_match (pi, &probes[i].printers);
+            if (match) {
+                log_it ("preferring '%s' over '%s'\n", match->uri, pi->uri);
+                p->data = match;
+                break;
+            }
+        }
+    }
+
+    for (i = 1; i < G_N_ELEMENTS (probes); i++) {
+        g_slist_free (probes[i].printers);
+    }
+
+    *list = probes[0].printers;
+    return TRUE;
+}
+
+/*
+ * Get the udis of the printers HAL knows about, sorted.  The returned
+ * array needs to be freed with libhal_free_string_array().
+ */
+static gchar **get_hal_printers (gint *n)
+{
+    gchar **udis;
+
+    trace_add (TRACE_HAL_CALLS, 1);
+    udis = libhal_find_device_by_capability (hal_ctx, "printer", n, NULL);
+    if (udis)
+        qsort (udis, *n, sizeof (gchar *), compare_strings);
+    else
+        *n = 0;
+
+    return udis;
+}
+
+/*
+ * See if a saved snapshot still describes the attached printers.  It
+ * has to be younger than the TTL, and it has to have been taken after
+ * HAL saw the printer we're being called for.  If we weren't called
+ * from a HAL callout, HAL has to know about the same printers now as
+ * it did when the snapshot was taken.
+ */
+static gboolean detected_snapshot_is_current (GKeyFile *kf)
+{
+    const gchar *udi = g_getenv ("HAL_PROP_INFO_UDI");
+    gchar **saved, **udis;
+    gsize n_saved;
+    gint i, n;
+    time_t now = time (NULL), taken;
+    gboolean ret = FALSE;
+
+    taken = g_key_file_get_integer (kf, "Snapshot", "Time", NULL);
+    if (taken > now || now - taken >= config->detected_ttl)
+        return FALSE;
+
+    saved = g_key_file_get_string_list (kf, "Snapshot", "HALPrinters", &n_saved, NULL);
+
+    if (udi) {
+        for (i = 0; saved && i < n_saved && !ret; i++)
+            ret = !strcmp (saved[i], udi);
+    } else {
+        udis = get_hal_printers (&n);
+        ret = (saved ? n_saved : 0) == n;
+        for (i = 0; ret && i < n; i++)
+            ret = !strcmp (saved[i], udis[i]);
+
+        if (udis)
+            libhal_free_string_array (udis);
+    }
+
+    g_strfreev (saved);
+    return ret;
+}
+
+static gchar *get_arena_string (GKeyFile *kf, const gchar *group, const gchar *key)
+{
+    gchar *value = g_key_file_get_string (kf, group, key, NULL);
+    gchar *ret = arena_strdup (value);
+
+    g_free (value);
+    return ret;
+}
+
+/*
+ * Load the detected printers from the snapshot saved by an earlier run,
+ * if it's still current.
+ */
+static gboolean load_detected_snapshot (GSList **list)
+{
+    GKeyFile *kf;
+    gchar **groups;
+    gsize n;
+    gint i;
+
+    if (config->detected_ttl <= 0)
+        return FALSE;
+
+    kf = g_key_file_new ();
+    if (!g_key_file_load_from_file (kf, DETECTED_FILE, G_KEY_FILE_NONE, NULL) ||
+        !detected_snapshot_is_current (kf)) {
+        g_key_file_free (kf);
+        return FALSE;
+    }
+
+    groups = g_key_file_get_groups (kf, &n);
+    for (i = 0; i < n; i++) {
+        PrinterInfo *pi;
+
+        if (strncmp (groups[i], "Printer ", 8))
+            continue;
+
+        pi = arena_alloc0 (sizeof (PrinterInfo));
+        pi->uri = get_arena_string (kf, groups[i], "URI");
+        pi->make_and_model = get_arena_string (kf, groups[i], "MakeAndModel");
+        pi->device_id = get_arena_string (kf, groups[i], "DeviceID");
+        pi->description = get_arena_string (kf, groups[i], "Description");
+        pi->alt_description = get_arena_string (kf, groups[i], "AltDescription");
+
+        if (!pi->uri || !pi->make_and_model)
+            continue;
+
+        parse_1284_id (pi->device_id, &pi->id);
+        *list = g_slist_prepend (*list, pi);
+        log_debug ("snapshot printer '%s' - '%s'\n", pi->uri, pi->make_and_model);
+    }
+
+    *list = g_slist_reverse (*list);
+    g_strfreev (groups);
+    g_key_file_free (kf);
+    return TRUE;
+}
+
+static void set_optional_string (GKeyFile *kf, const gchar *group, const gchar *key, const gchar *value)
+{
+    if (value)
+        g_key_file_set_string (kf, group, key, value);
+}
+
+/*
+ * Save the detected printers so that the callouts for the other
+ * printers on the same hub don't have to run the backends again.
+ * The HAL printers are recorded before the backends are run.
+ */
+static void save_detected_snapshot (GSList *list, gchar **udis, gint n_udis, time_t taken)
+{
+    GKeyFile *kf;
+    GError *err = NULL;
+    GSList *l;
+    gchar *data;
+    gsize len;
+    gint i;
+
+    kf = g_key_file_new ();
+    g_key_file_set_integer (kf, "Snapshot", "Time", taken);
+    g_key_file_set_string_list (kf, "Snapshot", "HALPrinters", (const gchar * const *) udis, n_udis);
+
+    for (l = list, i = 0; l; l = l->next, i++) {
+        PrinterInfo *pi = l->data;
+        gchar *group = g_strdup_printf ("Printer %d", i);
+
+        g_key_file_set_string (kf, group, "URI", pi->uri);
+        g_key_file_set_string (kf, group, "MakeAndModel", pi->make_and_model);
+        set_optional_string (kf, group, "DeviceID", pi->device_id);
+        set_optional_string (kf, group, "Description", pi->description);
+        set_optional_string (kf, group, "AltDescription", pi->alt_description);
+        g_free (group);
+    }
+
+    data = g_key_file_to_data (kf, &len, NULL);
+    if (g_mkdir_with_parents (CACHE_DIR, 0755)) {
+        log_error ("Failed to create '%s': %s\n", CACHE_DIR, strerror (errno));
+    } else if (!g_file_set_contents (DETECTED_FILE, data, len, &err)) {
+        log_error ("Failed to save detected printers: %s\n", err->message);
+        g_error_free (err);
+    }
+
+    g_free (data);
+    g_key_file_free (kf);
+}
+
+static void free_detected_printers (void)
+{
+    if (detected_by_serial) {
+        g_hash_table_destroy (detected_by_serial);
+        detected_by_serial = NULL;
+    }
+
+    if (detected_by_model) {
+        g_hash_table_destroy (detected_by_model);
+        detected_by_model = NULL;
+    }
+
+    g_slist_free (detected_printers);
+    detected_printers = NULL;
+    have_detected_printers = FALSE;
+}
+
+/*
+ * Forget the detected printers, i.e. because a printer was removed.
+ */
+static void invalidate_detected_printers (void)
+{
+    free_detected_printers ();
+    g_unlink (DETECTED_FILE);
+}
+
+/*
+ * Get the printers that the cups backends detect.  The backends are
+ * only run once per run, or not at all if a recent enough snapshot
+ * was saved by an earlier run.  The returned list is shared and must
+ * not be freed by the caller.
+ */
+static GSList *get_detected_printers (void)
+{
+    gchar **udis = NULL;
+    gint n = 0;
+    time_t taken;
+    gboolean complete;
+
+    if (have_detected_printers)
+        return detected_printers;
+
+    if (load_detected_snapshot (&detected_printers)) {
+        log_it ("Using the detected printers snapshot\n");
+        have_detected_printers = TRUE;
+        return detected_printers;
+    }
+
+    taken = time (NULL);
+    if (config->detected_ttl > 0)
+        udis = get_hal_printers (&n);
+
+    if (probe_detected_printers (&detected_printers, &complete)) {
+        have_detected_printers = TRUE;
+
+        /* don't let later runs miss what a slow backend didn't list */
+        if (config->detected_ttl > 0 && complete)
+            save_detected_snapshot (detected_printers, udis, n, taken);
+    }
+
+    if (udis)
+        libhal_free_string_array (udis);
+
+    return detected_printers;
+}
+
+static void index_serial (GHashTable *by_serial, gchar *serial, PrinterInfo *pi)
+{
+    if (serial && *serial && !g_hash_table_lookup (by_serial, serial))
+        g_hash_table_insert (by_serial, serial, pi);
+    else
+        g_free (serial);
+}
+
+/*
+ * Index the detected printers by the serial numbers in their uris and
+ * 1284 ids.
+ */
+static void index_detected_serials (void)
+{
+    GSList *d;
+
+    detected_by_serial = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    for (d = detected_printers; d; d = d->next) {
+        PrinterInfo *pi = d->data;
+        const gchar *ser = strstr (pi->uri, "?serial=");
+
+        if (ser)
+            index_serial (detected_by_serial, g_strdup (ser + 8), pi);
+        index_serial (detected_by_serial, id_field_dup (&pi->id.sn), pi);
+    }
+}
+
+/*
+ * Get the detected printers for a make, indexed by their lower-cased
+ * model with the make stripped off.
+ */
+static GHashTable *get_detected_models (const gchar *make)
+{
+    GHashTable *models;
+    GSList *d;
+
+    if (!detected_by_model)
+        detected_by_model = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                   (GDestroyNotify) g_hash_table_destroy);
+
+    models = g_hash_table_lookup (detected_by_model, make);
+    if (models)
+        return models;
+
+    models = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    for (d = detected_printers; d; d = d->next) {
+        PrinterInfo *pi = d->data;
+        gchar *mdl = model_from_string (make, pi->make_and_model);
+        gchar *key = g_ascii_strdown (mdl, -1);
+
+        if (!g_hash_table_lookup (models, key))
+            g_hash_table_insert (models, key, pi);
+        else
+            g_free (key);
+        g_free (mdl);
+    }
+
+    g_hash_table_insert (detected_by_model, g_strdup (make), models);
+    return models;
+}
+
+/*
+ * Find the detected printer that matches a HAL printer, by serial
+ * number if HAL has one and by make and model otherwise.  This is
+ * printer_matches_hal_properties() with the detected printers
+ * indexed, so the HAL properties are only read once.
+ */
+static PrinterInfo *find_detected_printer (const gchar *hal_udi)
+{
+    gchar *make = NULL, *model = NULL, *serial = NULL;
+    gchar *um = NULL, *key = NULL;
+    const gchar *vendor;
+    PrinterInfo *pi = NULL;
+
+    if (!get_detected_printers ())
+        return NULL;
+
+    make = hal_get_string (hal_udi, "printer.vendor");
+    model = hal_get_string (hal_udi, "printer.product");
+    serial = hal_get_string (hal_udi, "printer.serial");
+
+    log_it ("HAL Printer properties make='%s' model='%s' serial='%s'\n", make, model, serial);
+
+    if (!model || !make)
+        goto done;
+
+    if (serial) {
+        if (!detected_by_serial)
+            index_detected_serials ();
+
+        pi = g_hash_table_lookup (detected_by_serial, serial);
+        if (pi)
+            goto matched;
+    }
+
+    /* check our vendor mappings */
+    vendor = g_strstrip (make);
+    um = g_ascii_strup (vendor, -1);
+    if (g_hash_table_lookup (vendor_map, um))
+        vendor = g_hash_table_lookup (vendor_map, um);
+
+    key = g_ascii_strdown (g_strstrip (model), -1);
+    pi = g_hash_table_lookup (get_detected_models (vendor), key);
+    if (!pi) {
+        log_it ("no detected printer matched model '%s' with make '%s'\n", model, vendor);
+        goto done;
+    }
+
+matched:
+    /* detected printers are shared, so this might not be the first match */
+    pi->make = arena_intern (make);
+    pi->model = arena_intern (model);
+    pi->serial = arena_intern (serial);
+
+done:
+    g_free (um);
+    g_free (key);
+    g_free (make);
+    g_free (model);
+    g_free (serial);
+    return pi;
+}
+
+/*
+ * Get the list of printers already added to cups.
+ */
+static gboolean get_cups_printers (GSList **list)
+{
+    ipp_t *request, *response;
+    ipp_attribute_t *attr;
+
+    request = ippNewRequest (CUPS_GET_PRINTERS);
+    response = cups_do_request (request, "get_cups_printers");
+    if (!response || response->request.status.status_code > IPP_OK_CONFLICT) {
+        log_error ("Failed to get the list of printers from cupsd\n");
+        return FALSE;
+    }
+
+    for (attr = response->attrs; attr; attr = attr->next) {
+        PrinterInfo *pi;
+
+        while (attr != NULL && attr->group_tag != IPP_TAG_PRINTER)
+            attr = attr->next;
+
+        if (!attr)
+            break;
+
+        pi = arena_alloc0 (sizeof (PrinterInfo));
+
+        for (; attr && attr->group_tag == IPP_TAG_PRINTER; attr = attr->next) {
+            if (!strncmp (attr->name, "device-uri", 10) && attr->value_tag == IPP_TAG_URI) {
+                pi->uri = arena_strdup (attr->values[0].string.text);
+            } else if (!strncmp (attr->name, "printer-name", 12) && attr->value_tag == IPP_TAG_NAME) {
+                pi->name = arena_strdup (attr->values[0].string.text);
+            } else if (!strcmp ("printer-make-and-model", attr->name)) {
+                pi->make_and_model = arena_strdup (attr->values[0].string.text);
+            } else if (!strcmp ("printer-state", attr->name) && attr->value_tag == IPP_TAG_ENUM) {
+                pi->state = attr->values[0].integer;
+            }
+        }
+
+        if (pi->uri && pi->name) {
+            *list = g_slist_prepend (*list, pi);
+            log_debug ("CUPS printer '%s' - '%s'\n", pi->uri, pi->name);
+        }
+        
+        if (!attr)
+            break;
+    }
+
+    *list = g_slist_reverse (*list);
+    ippDelete (response);
+    return TRUE;
+}
+
+/*
+ * Build the request that adds and enables a new print queue.
+ */
+static ipp_t *new_add_printer_request (const gchar *uri, const gchar *ppd_file, const gchar *printer_name)
+{
+    ipp_t *request;
+	gchar local_uri [HTTP_MAX_URI + 1];
+  
+    g_snprintf (local_uri, sizeof local_uri - 1,
+		        "ipp://localhost/printers/%s", printer_name);
+    
+    request = ippNewRequest (CUPS_ADD_MODIFY_PRINTER);
+	ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+		          "printer-uri", NULL, local_uri);
+	ippAddString (request,	IPP_TAG_PRINTER, IPP_TAG_NAME,
+		          "printer-name", NULL, printer_name);
+	ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_NAME,
+		          "ppd-name", NULL, ppd_file);
+	ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_URI,
+		          "device-uri", NULL, uri);
+	ippAddBoolean (request, IPP_TAG_PRINTER, "printer-is-accepting-jobs", 1);
+	ippAddInteger(request, IPP_TAG_PRINTER, IPP_TAG_ENUM, "printer-state",
+                  IPP_PRINTER_IDLE);
+
+    if (config->default_policy)
+        ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_NAME,
+                      "printer-op-policy", NULL, config->default_policy);
+
+    return request;
+}
+
+/*
+ * Build the request that removes a printer queue.
+ */
+static ipp_t *new_delete_printer_request (const gchar *printer_name)
+{
+    ipp_t *request;
+	gchar local_uri [HTTP_MAX_URI + 1];
+    
+    request = ippNewRequest (CUPS_DELETE_PRINTER);
+    
+    g_snprintf (local_uri, sizeof local_uri - 1,
+		        "ipp://localhost/printers/%s", printer_name);
+	ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+		          "printer-uri", NULL, local_uri);
+
+    return request;
+}
+
+/*
+ * Build the request that enables or disables a printer.
+ */
+static ipp_t *new_printer_status_request (const gchar *printer_name, gboolean enable)
+{
+    ipp_t *request;
+	gchar local_uri [HTTP_MAX_URI + 1];
+    
+    request = enable ? ippNewRequest (IPP_RESUME_PRINTER) :
+                       ippNewRequest (IPP_PAUSE_PRINTER);
+    
+    g_snprintf (local_uri, sizeof local_uri - 1,
+		        "ipp://localhost/printers/%s", printer_name);
+	ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+		          "printer-uri", NULL, local_uri);
+
+    return request;
+}
+
+static IppBatch *ipp_batch_new (void)
+{
+    IppBatch *batch = g_new0 (IppBatch, 1);
+
+    batch->requests = g_ptr_array_new ();
+    batch->status = g_array_new (FALSE, FALSE, sizeof (ipp_status_t));
+    return batch;
+}
+
+static void ipp_batch_free (IppBatch *batch)
+{
+    guint i;
+
+    for (i = 0; i < batch->requests->len; i++)
+        ippDelete (g_ptr_array_index (batch->requests, i));
+
+    g_ptr_array_free (batch->requests, TRUE);
+    g_array_free (batch->status, TRUE);
+    g_free (batch);
+}
+
+/*
+ * Queue a request, which the batch takes over.  Returns the request's
+ * index in the batch.
+ */
+static guint ipp_batch_add (IppBatch *batch, ipp_t *request)
+{
+    ipp_status_t status = IPP_INTERNAL_ERROR;
+
+    g_ptr_array_add (batch->requests, request);
+    g_array_append_val (batch->status, status);
+    return batch->requests->len - 1;
+}
+
+static gboolean ipp_batch_ok (IppBatch *batch, guint i)
+{
+    return g_array_index (batch->status, ipp_status_t, i) <= IPP_OK_CONFLICT;
+}
+
+/*
+ * Send the requests in the batch one after another on the shared
+ * connection, which cupsd keeps alive between them, and keep the
+ * status cupsd answered each one with.  Each request is answered
+ * before the next is sent, since an http_t only follows one request
+ * at a time.
+ */
+static void ipp_batch_send (IppBatch *batch)
+{
+    TraceSpan span;
+    guint i;
+
+    trace_begin (&span);
+    for (i = 0; i < batch->requests->len; i++) {
+        ipp_t *response;
+
+        response = cups_do_request (g_ptr_array_index (batch->requests, i), "ipp_request");
+        g_ptr_array_index (batch->requests, i) = NULL;
+
+        if (response)
+            g_array_index (batch->status, ipp_status_t, i) = response->request.status.status_code;
+        ippDelete (response);
+    }
+
+    trace_end (&span, "ipp_batch_send");
+}
+
+/*
+ * What the child that reads a device's IEEE 1284 id sends back.
+ */
+typedef struct _DeviceIdResult {
+    gint failed;
+    gint err;
+    gchar buff[1024];
+} DeviceIdResult;
+
+/*
+ * Read the IEEE 1284 id from a printer device.  The read is done by a
+ * child process, so a printer that's busy, asleep or wedged costs at
+ * most DEVICE_ID_TIMEOUT seconds: the child is killed after that, and
+ * reaped later if it's stuck in the kernel.  The device is opened
+ * non-blocking, so an offline printer doesn't hold up the open.
+ */
+static gchar *read_1284_id (const char *device)
+{
+    DeviceIdResult result;
+    gint64 deadline;
+    unsigned int length;
+    gsize got = 0;
+    gboolean timed_out = FALSE;
+    int fds[2];
+    pid_t pid;
+
+    if (pipe (fds)) {
+        log_error ("pipe failed: %s\n", strerror (errno));
+        return NULL;
+    }
+
+    pid = fork ();
+    if (pid == -1) {
+        log_error ("fork failed: %s\n", strerror (errno));
+        close (fds[0]);
+        close (fds[1]);
+        return NULL;
+    }
+
+    if (pid == 0) {
+        /* only async-signal-safe calls here, the log writer has a lock */
+        int fd;
+
+        close (fds[0]);
+        memset (&result, 0, sizeof (result));
+        fd = open (device, O_RDWR | O_NONBLOCK | O_NOCTTY);
+        if (fd == -1) {
+            result.failed = 'o';
+            result.err = errno;
+        } else {
+            if (ioctl (fd, LPIOC_GET_DEVICE_ID (sizeof (result.buff)), result.buff)) {
+                result.failed = 'i';
+                result.err = errno;
+            }
+            close (fd);
+        }
+
+        write (fds[1], &result, sizeof (result));
+        _exit (0);
+    }
+
+    close (fds[1]);
+    deadline = get_time_us () + (gint64) DEVICE_ID_TIMEOUT * G_USEC_PER_SEC;
+    while (got < sizeof (result)) {
+        gint64 left = deadline - get_time_us ();
+        struct pollfd pfd = { fds[0], POLLIN, 0 };
+        gssize n;
+
+        if (left <= 0) {
+            timed_out = TRUE;
+            break;
+        }
+
+        n = poll (&pfd, 1, (left + 999) / 1000);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            timed_out = n == 0;
+            break;
+        }
+
+        n = read (fds[0], (gchar *) &result + got, sizeof (result) - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+
+        got += n;
+    }
+
+    close (fds[0]);
+    if (got < sizeof (result)) {
+        log_error ("Failed to read the id of '%s': %s\n", device,
+                   timed_out ? "timed out" : "no answer");
+        kill (pid, SIGKILL);
+        if (waitpid (pid, NULL, WNOHANG) == 0)
+            leave_child (pid);
+        return NULL;
+    }
+
+    waitpid (pid, NULL, 0);
+    if (result.failed) {
+        log_error ("%s of '%s' failed: %s\n", result.failed == 'o' ? "open" : "ioctl",
+                   device, strerror (result.err));
+        return NULL;
+    }
+
+    /* the length includes the two length bytes, and can't be trusted */
+    length = (((unsigned) result.buff[0] & 255) << 8) + ((unsigned) result.buff[1] & 255);
+    if (length <= 2)
+        return NULL;
+
+    if (length > sizeof (result.buff) - 1)
+        length = sizeof (result.buff) - 1;
+
+    result.buff[length] = '\0';
+    return g_strdup (result.buff + 2);
+}
+
+static void free_cached_device_id (gpointer data)
+{
+    CachedDeviceId *cached = data;
+
+    g_free (cached->id);
+    g_free (cached);
+}
+
+/*
+ * Get the IEEE 1284 id from a printer device.  Each device is only
+ * read once, and again after it has been plugged in again.  If the
+ * return value is non-NULL then it needs to be freed by
+ * the caller.
+ */
+static gchar *get_1284_id_from_device (const char *device)
+{
+    CachedDeviceId *cached;
+    struct stat info;
+
+    if (stat (device, &info)) {
+        log_error ("stat of '%s' failed: %s\n", device, strerror (errno));
+        return NULL;
+    }
+
+    if (!device_ids)
+        device_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            free_cached_device_id);
+
+    cached = g_hash_table_lookup (device_ids, device);
+    if (!cached || cached->rdev != info.st_rdev || cached->ctime != info.st_ctime) {
+        cached = g_new0 (CachedDeviceId, 1);
+        cached->rdev = info.st_rdev;
+        cached->ctime = info.st_ctime;
+        cached->id = read_1284_id (device);
+        g_hash_table_replace (device_ids, g_strdup (device), cached);
+    }
+
+    return g_strdup (cached->id);
+}
+
+/*
+ * Find the corresponding usb backend printer for the given hal
+ * printer.  The returned string needs to be freed by the caller.
+ */
+static gchar *hal_to_usb_uri (PrinterInfo *hp)
+{
+    GSList *detected, *d;
+    gchar *ret = NULL, *ieee_id = NULL;
+    gboolean read_id = FALSE;
+    DeviceId hal_id;
+
+    detected = get_detected_printers ();
+    if (!detected) {
+        log_it ("There are no local printers detected\n");
+        return NULL;
+    }
+
+    for (d = detected; d; d = d->next) {
+        PrinterInfo *pi = d->data;
+        
+        /* use IEEE 1284 ids to match if we can */
+        if (pi->device_id) {
+            /* only read the id from the device once */
+            if (!read_id) {
+                gchar *dev_file = hal_get_string (hp->uri + 6, "linux.device_file");
+                if (dev_file) {
+                    ieee_id = get_1284_id_from_device (dev_file);
+                    g_free (dev_file);
+                }
+
+                parse_1284_id (ieee_id, &hal_id);
+                read_id = TRUE;
+            }
+
+            if (ieee_id) {
+                log_debug ("Trying to match 1284 ids '%s' and '%s'\n", pi->device_id, ieee_id);
+                if (match_by_1284 (&pi->id, &hal_id)) {
+                    log_it ("1284 ids matched for '%s' and '%s'\n", pi->uri, hp->uri);
+                    ret = g_strdup (pi->uri);
+                    goto done;
+                } else {
+                    log_debug ("1284 ids didn't match\n");
+                    continue;
+                }
+            }
+        }
+
+        /* no 1284 id so we have to use string matching */
+        log_debug ("no 1284 ids, using string matching\n");
+        if (printer_matches_hal_properties (pi, hp->uri + 6)) {
+            log_it ("strings matched hal uri '%s'\n", hp->uri);
+            ret = g_strdup (pi->uri);
+            break;
+        } 
+    }
+
+done:
+    g_free (ieee_id);
+    return ret;
+}
+
+/*
+ * The key a make and model string is looked up by in the PPD
+ * catalog: lower-cased, without the " (recommended)" cupsd adds.
+ */
+static gchar *ppd_catalog_key (const gchar *mm)
+{
+    const gchar *p = strstr (mm, " (recommended)");
+
+    return g_ascii_strdown (mm, p ? p - mm : -1);
+}
+
+/*
+ * Fetch the PPD catalog from cupsd and index the ppd-names by make
+ * and model.  Where several PPDs have the same make and model the
+ * first one cupsd lists is kept.  Returns NULL if cupsd couldn't be
+ * asked.
+ */
+static GHashTable *load_ppd_catalog (void)
+{
+    GHashTable *catalog;
+    ipp_attribute_t *attr;
+    ipp_t *response;
+
+    response = get_ppds (NULL, NULL);
+    if (!response)
+        return NULL;
+
+    catalog = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    for (attr = response->attrs; attr; attr = attr ? attr->next : NULL) {
+        const gchar *name = NULL, *make_and_model = NULL;
+        gchar *key;
+
+        while (attr && attr->group_tag != IPP_TAG_PRINTER)
+            attr = attr->next;
+
+        if (!attr)
+            break;
+
+        for (; attr && attr->group_tag == IPP_TAG_PRINTER; attr = attr->next) {
+            if (!strcmp (attr->name, "ppd-name") && attr->value_tag == IPP_TAG_NAME) {
+                name = attr->values[0].string.text;
+            } else if (!strcmp (attr->name, "ppd-make-and-model") && attr->value_tag == IPP_TAG_TEXT) {
+                make_and_model = attr->values[0].string.text;
+            } 
+        }
+
+        trace_add (TRACE_PPDS_SCANNED, 1);
+        if (!name || !make_and_model)
+            continue;
+
+        key = ppd_catalog_key (make_and_model);
+        if (g_hash_table_lookup (catalog, key))
+            g_free (key);
+        else
+            g_hash_table_insert (catalog, key, g_strdup (name));
+    }
+
+    ippDelete (response);
+    return catalog;
+}
+
+/*
+ * Find the ppd-name for a queue's printer-make-and-model.
+ */
+static const gchar *find_ppd_in_catalog (GHashTable *catalog, const gchar *mm)
+{
+    gchar *key = ppd_catalog_key (mm);
+    const gchar *ppd = g_hash_table_lookup (catalog, key);
+
+    log_debug ("PPD for '%s' is '%s'\n", mm, ppd);
+    g_free (key);
+    return ppd;
+}
+
+/*
+ * Move all hal backend printers to the usb backend.  The PPD catalog
+ * is only fetched if there are any, and then only once, and all the
+ * queues are changed in one batch.  A queue keeps its name, so it's
+ * changed in place.
+ */
+static gboolean migrate_hal_printers (void)
+{
+    GSList *configured = NULL, *c = NULL;
+    GHashTable *catalog = NULL;
+    GPtrArray *names = NULL;
+    IppBatch *batch = NULL;
+    TraceSpan span;
+    gboolean ret = TRUE;
+    guint i;
+
+    trace_begin (&span);
+    get_cups_printers (&configured);
+    
+    for (c = configured; c; c = c->next) {
+        PrinterInfo *tmp = c->data;
+        const gchar *ppd_file;
+        gchar *usb_uri;
+
+        if (strncmp (tmp->uri, "hal://", 6))
+            continue;
+
+        if (!catalog) {
+            catalog = load_ppd_catalog ();
+            if (!catalog) {
+                ret = FALSE;
+                goto done;
+            }
+
+            batch = ipp_batch_new ();
+            names = g_ptr_array_new ();
+        }
+
+        usb_uri = hal_to_usb_uri (tmp);
+        if (!usb_uri)
+            continue;
+
+        log_it ("hal uri '%s' matched uri '%s'\n", tmp->uri, usb_uri);
+        ppd_file = find_ppd_in_catalog (catalog, tmp->make_and_model);
+        if (!ppd_file) {
+            log_error ("Failed to find matching ppd for '%s' '%s'\n", tmp->uri, tmp->make_and_model);
+            g_free (usb_uri);
+            ret = FALSE;
+            continue;
+        }
+            
+        log_it ("Found matching ppd '%s'\n", ppd_file);
+        ipp_batch_add (batch, new_add_printer_request (usb_uri, ppd_file, tmp->name));
+        g_ptr_array_add (names, tmp->name);
+        g_free (usb_uri);
+    }
+
+    if (batch) {
+        ipp_batch_send (batch);
+        for (i = 0; i < names->len; i++) {
+            if (!ipp_batch_ok (batch, i)) {
+                log_error ("Failed to move '%s' to the usb backend\n",
+                           (gchar *) g_ptr_array_index (names, i));
+                ret = FALSE;
+            }
+        }
+    }
+
+done:
+    if (catalog)
+        g_hash_table_destroy (catalog);
+    if (batch)
+        ipp_batch_free (batch);
+    if (names)
+        g_ptr_array_free (names, TRUE);
+    g_slist_free (configured);
+    trace_end (&span, "migrate_hal_printers");
+    return ret;
+}
+
+/*
+ * Fingerprint a HAL printer by its 1284 make, model and serial
+ * number, which HAL gets from the printer or its usb descriptors.
+ * Printers without a serial number can't be told apart, so they don't
+ * get one.  The returned string needs to be freed by the caller.
+ */
+static gchar *hal_fingerprint (const gchar *udi)
+{
+    gchar *make, *model, *serial, *ret = NULL;
+
+    make = hal_get_string (udi, "printer.vendor");
+    model = hal_get_string (udi, "printer.product");
+    serial = hal_get_string (udi, "printer.serial");
+
+    if (make && model && serial && *g_strstrip (serial)) {
+        ret = g_strdup_printf ("%s;%s;%s", g_strstrip (make), g_strstrip (model), serial);
+        g_strdelimit (ret, "[]\n", '_');
+    }
+
+    g_free (make);
+    g_free (model);
+    g_free (serial);
+    return ret;
+}
+
+/*
+ * The queues we've set up, keyed by the fingerprint of their printer,
+ * so that a printer that's plugged in again can be put back on its
+ * queue without running the backends or picking a PPD.
+ */
+static GKeyFile *get_fingerprints (void)
+{
+    if (!fingerprints) {
+        fingerprints = g_key_file_new ();
+        g_key_file_load_from_file (fingerprints, FINGERPRINTS_FILE, G_KEY_FILE_NONE, NULL);
+    }
+
+    return fingerprints;
+}
+
+static void remember_queue (const gchar *fp, const gchar *name, const gchar *uri,
+                            const gchar *ppd)
+{
+    GKeyFile *kf = get_fingerprints ();
+
+    if (!fp)
+        return;
+
+    g_key_file_remove_group (kf, fp, NULL);
+    g_key_file_set_string (kf, fp, "Name", name);
+    g_key_file_set_string (kf, fp, "URI", uri);
+    set_optional_string (kf, fp, "PPD", ppd);
+    fingerprints_changed = TRUE;
+}
+
+static void save_fingerprints (void)
+{
+    GError *err = NULL;
+    gchar *data;
+    gsize len;
+
+    if (!fingerprints_changed)
+        return;
+
+    data = g_key_file_to_data (fingerprints, &len, NULL);
+    if (g_mkdir_with_parents (CACHE_DIR, 0755)) {
+        log_error ("Failed to create '%s': %s\n", CACHE_DIR, strerror (errno));
+    } else if (!g_file_set_contents (FINGERPRINTS_FILE, data, len, &err)) {
+        log_error ("Failed to save printer fingerprints: %s\n", err->message);
+        g_error_free (err);
+    }
+
+    fingerprints_changed = FALSE;
+    g_free (data);
+}
+
+/*
+ * Put the printers we've seen before back on their queues, with one
+ * batch of resume requests.  fps gets the fingerprint of each udi.
+ * handled is set for the printers that were put back, and if uris
+ * isn't NULL it gets their queue's uri.  A queue that can't be resumed
+ * has probably been deleted, so it's forgotten and the printer goes
+ * the long way round.
+ */
+static gint reattach_printers (const gchar * const *udis, gint n, gchar **fps,
+                               gboolean *handled, gchar **uris)
+{
+    GKeyFile *kf = get_fingerprints ();
+    IppBatch *batch = ipp_batch_new ();
+    gchar **names = g_new0 (gchar *, n);
+    gchar **queue_uris = g_new0 (gchar *, n);
+    gint *ops = g_new (gint, n);
+    gint i, count = 0;
+
+    for (i = 0; i < n; i++) {
+        ops[i] = -1;
+        fps[i] = hal_fingerprint (udis[i]);
+        if (!fps[i])
+            continue;
+
+        names[i] = g_key_file_get_string (kf, fps[i], "Name", NULL);
+        queue_uris[i] = g_key_file_get_string (kf, fps[i], "URI", NULL);
+        if (!names[i] || !queue_uris[i])
+            continue;
+
+        log_it ("Reattaching '%s' to queue '%s'\n", udis[i], names[i]);
+        ops[i] = ipp_batch_add (batch, new_printer_status_request (names[i], TRUE));
+    }
+
+    if (batch->requests->len)
+        ipp_batch_send (batch);
+
+    for (i = 0; i < n; i++) {
+        if (ops[i] < 0)
+            continue;
+
+        if (!ipp_batch_ok (batch, ops[i])) {
+            log_it ("Failed to resume queue '%s', forgetting it\n", names[i]);
+            g_key_file_remove_group (kf, fps[i], NULL);
+            fingerprints_changed = TRUE;
+            continue;
+        }
+
+        set_printer_configured_existing_property (udis[i], names[i]);
+        if (uris) {
+            uris[i] = queue_uris[i];
+            queue_uris[i] = NULL;
+        }
+        handled[i] = TRUE;
+        count++;
+    }
+
+    for (i = 0; i < n; i++) {
+        g_free (names[i]);
+        g_free (queue_uris[i]);
+    }
+
+    ipp_batch_free (batch);
+    g_free (names);
+    g_free (queue_uris);
+    g_free (ops);
+    return count;
+}
+
+/*
+ * Get printer information from HAL, cups, and the cups backends
+ * and add the new printers, if necessary.  If udis is NULL all the
+ * printers HAL knows about are added.  If uris isn't NULL it gets
+ * the uri each of the udis matched, which need to be freed by the
+ * caller.
+ */
+static gboolean add_printers (const gchar * const *udis, gint n, gchar **uris)
+{
+    char **all = NULL;
+    GSList *configured = NULL, *c;
+    GHashTable *by_uri = NULL, *by_name = NULL;
+    IppBatch *batch = NULL;
+    const gchar **names = NULL, **queue_uris = NULL;
+    gchar **fps = NULL, **ppds = NULL;
+    PrinterInfo **new_printers = NULL;
+    TraceSpan span, step;
+    gint *ops = NULL;
+    gboolean *resumes = NULL, *handled = NULL, ret = FALSE;
+    int i;
+    
+    if (!config->add) {
+        g_print ("skipping, CUPS_AUTOCONFIG_ENABLE is not yes\n");
+        return TRUE;
+    }
+
+    trace_begin (&span);
+    if (!udis) {
+        trace_add (TRACE_HAL_CALLS, 1);
+        all = libhal_find_device_by_capability (hal_ctx, "printer", &n, NULL);
+        udis = (const gchar * const *) all;
+    }
+
+    /* printers we've seen before don't need the backends run */
+    fps = g_new0 (gchar *, n);
+    handled = g_new0 (gboolean, n);
+    if (reattach_printers (udis, n, fps, handled, uris) == n) {
+        ret = TRUE;
+        goto done;
+    }
+
+    get_cups_printers (&configured);
+    by_uri = g_hash_table_new (g_str_hash, g_str_equal);
+    by_name = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    for (c = configured; c; c = c->next)
+        index_printer (c->data, by_uri, by_name);
+
+    if (!get_detected_printers ()) {
+        log_error ("Failed to detect backend printers\n");
+        goto done;
+    }
+
+    /* the queues are added and resumed in one batch at the end */
+    batch = ipp_batch_new ();
+    ops = g_new (gint, n);
+    names = g_new0 (const gchar *, n);
+    queue_uris = g_new0 (const gchar *, n);
+    ppds = g_new0 (gchar *, n);
+    resumes = g_new0 (gboolean, n);
+    new_printers = g_new0 (PrinterInfo *, n);
+   
+    for (i = 0; i < n; i++) {
+        PrinterInfo *new_printer = NULL, *old_printer = NULL;
+
+        ops[i] = -1;
+        if (handled[i])
+            continue;
+
+        /* see if the detected printer matches our hal printer */
+        trace_begin (&step);
+        new_printer = find_detected_printer (udis[i]);
+        trace_end (&step, "find_detected_printer");
+        if (!new_printer) {
+            log_error ("Failed to find a printer that matches HAL properties\n");
+            continue;
+        }
+
+        if (uris)
+            uris[i] = g_strdup (new_printer->uri);
+
+        /* see if the printer is configured already */
+        old_printer = g_hash_table_lookup (by_uri, new_printer->uri);
+
+        /* make sure this printer is enabled */
+        if (old_printer) {
+            if (old_printer->state == IPP_PRINTER_STOPPED) {
+                log_it ("Enabling old printer '%s'\n", old_printer->name);
+                ops[i] = ipp_batch_add (batch, new_printer_status_request (old_printer->name, TRUE));
+                names[i] = old_printer->name;
+                resumes[i] = TRUE;
+            }
+            set_printer_configured_existing_property (udis[i], old_printer->name);
+            remember_queue (fps[i], old_printer->name, old_printer->uri, NULL);
+            continue;
+        }
+
+        new_printers[i] = new_printer;
+    }
+
+    /* the ppds for all the new printers are found together */
+    trace_begin (&step);
+    get_best_ppds (new_printers, n, ppds);
+    trace_end (&step, "get_best_ppds");
+
+    for (i = 0; i < n; i++) {
+        PrinterInfo *new_printer = new_printers[i], *added;
+        const gchar *ppd = ppds[i];
+
+        if (!new_printer)
+            continue;
+
+        /* more than one hal printer can match the same detected printer */
+        if (g_hash_table_lookup (by_uri, new_printer->uri)) {
+            added = g_hash_table_lookup (by_uri, new_printer->uri);
+            set_printer_configured_existing_property (udis[i], added->name);
+            remember_queue (fps[i], added->name, added->uri, NULL);
+            continue;
+        }
+
+        if (!ppd) {
+            log_error ("Failed to find PPD file for printer\n");
+            continue;
+        }
+
+        log_it ("selected ppd file is '%s'\n", ppd);
+
+        /* so the next printer doesn't get the same name */
+        added = arena_alloc0 (sizeof (PrinterInfo));
+        added->uri = new_printer->uri;
+        added->name = generate_printer_name (new_printer, by_name);
+        configured = g_slist_prepend (configured, added);
+        index_printer (added, by_uri, by_name);
+
+        log_it ("adding queue with uri='%s' ppd='%s' name='%s'\n",
+                added->uri, ppd, added->name);
+        ops[i] = ipp_batch_add (batch, new_add_printer_request (added->uri, ppd, added->name));
+        names[i] = added->name;
+        queue_uris[i] = added->uri;
+    }
+
+    ipp_batch_send (batch);
+
+    for (i = 0; i < n; i++) {
+        if (ops[i] < 0)
+            continue;
+
+        if (!ipp_batch_ok (batch, ops[i]))
+            log_error (resumes[i] ? "Failed to change printer state of '%s'\n" :
+                                    "Failed to add print queue '%s'\n", names[i]);
+        else if (!resumes[i]) {
+            set_printer_configured_property (udis[i], names[i]);
+            remember_queue (fps[i], names[i], queue_uris[i], ppds[i]);
+        }
+    }
+
+    ret = TRUE;
+
+done:
+    save_fingerprints ();
+    for (i = 0; i < n; i++) {
+        g_free (fps[i]);
+        if (ppds)
+            g_free (ppds[i]);
+    }
+
+    if (all)
+        libhal_free_string_array (all);
+    if (batch)
+        ipp_batch_free (batch);
+    if (by_uri)
+        g_hash_table_destroy (by_uri);
+    if (by_name)
+        g_hash_table_destroy (by_name);
+    g_free (fps);
+    g_free (ppds);
+    g_free (new_printers);
+    g_free (handled);
+    g_free (ops);
+    g_free (names);
+    g_free (queue_uris);
+    g_free (resumes);
+    g_slist_free (configured);
+    trace_end (&span, "add_printers");
+    return ret;
+}
+
+/*
+ * Look at the list of detected printers and the list of
+ * cups configured printers and disable the print queues
+ * for the printers that aren't present.  Queues whose uri
+ * is in keep are left alone.
+ */
+static gboolean disable_printers (GHashTable *keep)
+{
+    GSList *configured = NULL, *c = NULL, *d;
+    GHashTable *present;
+    IppBatch *batch;
+    TraceSpan span;
+    gboolean ret = TRUE;
+    guint i;
+
+    /*
+     * A printer went away, so any saved snapshot is out of date, even
+     * if its queue isn't going to be disabled.
+     */
+    invalidate_detected_printers ();
+
+    if (!config->remove) {
+        g_print ("skipping, CUPS_AUTOCONFIG_DISABLE is not 'yes'\n");
+        return TRUE;
+    }
+    
+    trace_begin (&span);
+    get_cups_printers (&configured);
+    if (!configured) {
+        g_print ("There are no configured printers, nothing to do\n");
+        trace_end (&span, "disable_printers");
+        return TRUE;
+    }
+
+    present = g_hash_table_new (g_str_hash, g_str_equal);
+    for (d = get_detected_printers (); d; d = d->next) {
+        PrinterInfo *dp = d->data;
+        g_hash_table_insert (present, dp->uri, dp);
+    }
+
+    batch = ipp_batch_new ();
+    
+    for (c = configured; c; c = c->next) {
+        PrinterInfo *pi = c->data;
+
+        if (!uri_is_local (pi->uri) || pi->state == IPP_PRINTER_STOPPED)
+            continue;
+
+        if (keep && g_hash_table_lookup (keep, pi->uri))
+            continue;
+
+        if (g_hash_table_lookup (present, pi->uri))
+            continue;
+
+        log_it ("Disabling printer '%s'\n", pi->name);
+        ipp_batch_add (batch, new_printer_status_request (pi->name, FALSE));
+    }
+
+    ipp_batch_send (batch);
+    for (i = 0; i < batch->requests->len; i++) {
+        if (!ipp_batch_ok (batch, i)) {
+            log_error ("Failed to change printer state\n");
+            ret = FALSE;
+        }
+    }
+
+    ipp_batch_free (batch);
+    g_hash_table_destroy (present);
+
+    g_slist_free (configured);
+    trace_end (&span, "disable_printers");
+    return ret;
+}
+
+typedef enum {
+    PLAN_ADD,
+    PLAN_MODIFY,
+    PLAN_RESUME,
+    PLAN_PAUSE,
+    PLAN_DELETE
+} PlanOpType;
+
+/*
+ * One step of a --reconcile plan.  udi is the HAL printer the queue
+ * is for, if there is one.
+ */
+typedef struct _PlanOp {
+    PlanOpType type;
+    gchar *name;
+    gchar *uri;
+    gchar *ppd;
+    gchar *udi;
+} PlanOp;
+
+static const gchar * const plan_op_names[] = {
+    "add", "modify", "resume", "pause", "delete"
+};
+
+static void plan_add (GPtrArray *plan, PlanOpType type, const gchar *name, const gchar *uri,
+                      const gchar *ppd, const gchar *udi)
+{
+    PlanOp *op = g_new0 (PlanOp, 1);
+
+    op->type = type;
+    op->name = g_strdup (name);
+    op->uri = g_strdup (uri);
+    op->ppd = g_strdup (ppd);
+    op->udi = g_strdup (udi);
+    g_ptr_array_add (plan, op);
+}
+
+static void free_plan_op (gpointer data, gpointer user_data)
+{
+    PlanOp *op = data;
+
+    g_free (op->name);
+    g_free (op->uri);
+    g_free (op->ppd);
+    g_free (op->udi);
+    g_free (op);
+}
+
+/*
+ * Plan moving the hal backend queues to the usb backend.  The queue
+ * keeps its name, so it's modified in place, unless the printer has
+ * a usb queue already, in which case the hal queue goes.
+ */
+static void plan_migration (GPtrArray *plan, GSList *configured, GHashTable *by_uri)
+{
+    GHashTable *catalog = NULL;
+    GSList *c;
+
+    for (c = configured; c; c = c->next) {
+        PrinterInfo *pi = c->data;
+        const gchar *ppd;
+        gchar *usb_uri;
+
+        if (strncmp (pi->uri, "hal://", 6))
+            continue;
+
+        if (!catalog && !(catalog = load_ppd_catalog ()))
+            return;
+
+        usb_uri = hal_to_usb_uri (pi);
+        if (!usb_uri)
+            continue;
+
+        if (g_hash_table_lookup (by_uri, usb_uri)) {
+            plan_add (plan, PLAN_DELETE, pi->name, pi->uri, NULL, NULL);
+            g_free (usb_uri);
+            continue;
+        }
+
+        ppd = find_ppd_in_catalog (catalog, pi->make_and_model);
+        if (!ppd) {
+            log_error ("Failed to find matching ppd for '%s' '%s'\n", pi->uri, pi->make_and_model);
+            g_free (usb_uri);
+            continue;
+        }
+
+        plan_add (plan, PLAN_MODIFY, pi->name, usb_uri, ppd, NULL);
+
+        /* from now on the queue is the usb printer's */
+        g_hash_table_remove (by_uri, pi->uri);
+        pi->uri = arena_strdup (usb_uri);
+        g_free (usb_uri);
+        g_hash_table_insert (by_uri, pi->uri, pi);
+    }
+
+    if (catalog)
+        g_hash_table_destroy (catalog);
+}
+
+/*
+ * Work out what needs doing to bring the queues in line with the
+ * printers: the hal queues are migrated, every HAL printer gets an
+ * enabled queue, and the queues of local printers that aren't there
+ * any more are paused.  HAL, cupsd and the backends are each asked
+ * once.
+ */
+static gboolean build_plan (GPtrArray *plan)
+{
+    GSList *configured = NULL, *c;
+    GHashTable *by_uri, *by_name, *present;
+    PrinterInfo **new_printers;
+    gchar **udis, **ppds;
+    gint i, n;
+
+    if (!get_cups_printers (&configured))
+        return FALSE;
+
+    if (!get_detected_printers ()) {
+        log_error ("Failed to detect backend printers\n");
+        g_slist_free (configured);
+        return FALSE;
+    }
+
+    by_uri = g_hash_table_new (g_str_hash, g_str_equal);
+    by_name = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    for (c = configured; c; c = c->next)
+        index_printer (c->data, by_uri, by_name);
+
+    plan_migration (plan, configured, by_uri);
+
+    present = g_hash_table_new (g_str_hash, g_str_equal);
+    udis = get_hal_printers (&n);
+    new_printers = g_new0 (PrinterInfo *, n);
+    ppds = g_new0 (gchar *, n);
+    for (i = 0; i < n; i++) {
+        PrinterInfo *pi, *old;
+
+        pi = find_detected_printer (udis[i]);
+        if (!pi) {
+            log_error ("Failed to find a printer that matches HAL properties\n");
+            continue;
+        }
+
+        g_hash_table_insert (present, pi->uri, pi);
+        old = g_hash_table_lookup (by_uri, pi->uri);
+        if (old) {
+            if (old->state == IPP_PRINTER_STOPPED)
+                plan_add (plan, PLAN_RESUME, old->name, old->uri, NULL, udis[i]);
+            continue;
+        }
+
+        if (config->add)
+            new_printers[i] = pi;
+    }
+
+    get_best_ppds (new_printers, n, ppds);
+
+    for (i = 0; i < n; i++) {
+        PrinterInfo *pi = new_printers[i], *added;
+
+        if (!pi || g_hash_table_lookup (by_uri, pi->uri))
+            continue;
+
+        if (!ppds[i]) {
+            log_error ("Failed to find PPD file for '%s'\n", pi->uri);
+            continue;
+        }
+
+        /* so the next printer doesn't get the same name */
+        added = arena_alloc0 (sizeof (PrinterInfo));
+        added->uri = pi->uri;
+        added->name = generate_printer_name (pi, by_name);
+        configured = g_slist_prepend (configured, added);
+        index_printer (added, by_uri, by_name);
+
+        plan_add (plan, PLAN_ADD, added->name, added->uri, ppds[i], udis[i]);
+    }
+
+    for (i = 0; i < n; i++)
+        g_free (ppds[i]);
+    g_free (ppds);
+    g_free (new_printers);
+
+    for (c = configured; c && config->remove; c = c->next) {
+        PrinterInfo *pi = c->data;
+
+        if (!uri_is_local (pi->uri) || pi->state == IPP_PRINTER_STOPPED ||
+            g_hash_table_lookup (present, pi->uri))
+            continue;
+
+        plan_add (plan, PLAN_PAUSE, pi->name, pi->uri, NULL, NULL);
+    }
+
+    if (udis)
+        libhal_free_string_array (udis);
+    g_hash_table_destroy (present);
+    g_hash_table_destroy (by_uri);
+    g_hash_table_destroy (by_name);
+    g_slist_free (configured);
+    return TRUE;
+}
+
+static void print_plan (GPtrArray *plan)
+{
+    guint i;
+
+    for (i = 0; i < plan->len; i++) {
+        PlanOp *op = g_ptr_array_index (plan, i);
+
+        g_print ("%-7s %s uri=%s", plan_op_names[op->type], op->name, op->uri);
+        if (op->ppd)
+            g_print (" ppd=%s", op->ppd);
+        g_print ("\n");
+    }
+
+    g_print ("%u operations\n", plan->len);
+}
+
+/*
+ * Carry out a plan with one batch of requests.
+ */
+static gboolean apply_plan (GPtrArray *plan)
+{
+    IppBatch *batch = ipp_batch_new ();
+    gboolean ret = TRUE;
+    guint i;
+
+    for (i = 0; i < plan->len; i++) {
+        PlanOp *op = g_ptr_array_index (plan, i);
+        ipp_t *request;
+
+        log_it ("plan: %s '%s' uri='%s'\n", plan_op_names[op->type], op->name, op->uri);
+        switch (op->type) {
+        case PLAN_ADD:
+        case PLAN_MODIFY:
+            request = new_add_printer_request (op->uri, op->ppd, op->name);
+            break;
+        case PLAN_RESUME:
+            request = new_printer_status_request (op->name, TRUE);
+            break;
+        case PLAN_PAUSE:
+            request = new_printer_status_request (op->name, FALSE);
+            break;
+        default:
+            request = new_delete_printer_request (op->name);
+            break;
+        }
+        ipp_batch_add (batch, request);
+    }
+
+    ipp_batch_send (batch);
+
+    for (i = 0; i < plan->len; i++) {
+        PlanOp *op = g_ptr_array_index (plan, i);
+        gchar *fp;
+
+        if (!ipp_batch_ok (batch, i)) {
+            log_error ("Failed to %s queue '%s'\n", plan_op_names[op->type], op->name);
+            ret = FALSE;
+            continue;
+        }
 
-    log_it ("attempting to remove '%s'\n", local_uri);
-    response = cupsDoRequest (global_cups_connection, request, "/");
-    if (!response || response->request.status.status_code > IPP_OK_CONFLICT) {
-        log_it ("Failed to remove printer\n");
-        goto done;
-    }
+        if (!op->udi)
+            continue;
 
-    ret = TRUE;
+        if (op->type == PLAN_ADD)
+            set_printer_configured_property (op->udi, op->name);
+        else
+            set_printer_configured_existing_property (op->udi, op->name);
 
-done:
-    ippDelete (response);
+        fp = hal_fingerprint (op->udi);
+        remember_queue (fp, op->name, op->uri, op->ppd);
+        g_free (fp);
+    }
+
+    save_fingerprints ();
+    ipp_batch_free (batch);
     return ret;
 }
 
 /*
- * Enable or disable a printer.
+ * Bring all the queues in line with the printers in one go.  With
+ * dry_run the plan is only printed.
  */
-static gboolean set_printer_status (const gchar *printer_name, gboolean enable)
+static gboolean reconcile_printers (gboolean dry_run)
 {
-    ipp_t *request, *response;
-    gboolean ret = FALSE;
-	gchar local_uri [HTTP_MAX_URI + 1];
-    
-    request = enable ? ippNewRequest (IPP_RESUME_PRINTER) :
-                       ippNewRequest (IPP_PAUSE_PRINTER);
-    
-    g_snprintf (local_uri, sizeof local_uri - 1,
-		        "ipp://localhost/printers/%s", printer_name);
-	ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
-		          "printer-uri", NULL, local_uri);
+    GPtrArray *plan = g_ptr_array_new ();
+    TraceSpan span;
+    gboolean ret;
 
-    response = cupsDoRequest (global_cups_connection, request, "/");
-    if (!response || response->request.status.status_code > IPP_OK_CONFLICT) {
-        log_it ("Failed to change printer state\n");
-        goto done;
-    }
+    trace_begin (&span);
+    ret = build_plan (plan);
+    trace_end (&span, "build_plan");
 
-    ret = TRUE;
+    if (ret) {
+        if (dry_run) {
+            print_plan (plan);
+        } else {
+            trace_begin (&span);
+            ret = apply_plan (plan);
+            trace_end (&span, "apply_plan");
+        }
+    }
 
-done:
-    ippDelete (response);
+    g_ptr_array_foreach (plan, free_plan_op, NULL);
+    g_ptr_array_free (plan, TRUE);
     return ret;
 }
 
 /*
- * Get the IEEE 1284 id from a printer device.  If the
- * return value is non-NULL then it needs to be freed by
- * the caller.
+ * See if a daemon other than us is already running.
  */
-static gchar *get_1284_id_from_device (const char *device)
+static gboolean daemon_is_running (void)
 {
-    int fd;
-    unsigned int length;
-    gchar buff[1024];
+    gchar *contents;
+    pid_t pid;
 
-    fd = open (device, O_RDWR);
-    if (fd == -1) {
-        log_it ("open failed: %s\n", strerror (errno));
-        return NULL;
-    }
+    if (!g_file_get_contents (PID_FILE, &contents, NULL, NULL))
+        return FALSE;
 
-    if (ioctl (fd, LPIOC_GET_DEVICE_ID(1024), buff)) {
-        log_it ("ioctl failed: %s\n", strerror (errno));
-        close (fd);
-        return NULL;
-    }
+    pid = atoi (contents);
+    g_free (contents);
+
+    return pid > 0 && pid != getpid () && (!kill (pid, 0) || errno == EPERM);
+}
+
+static void queue_hotplug_event (HotplugType type, const gchar *udi)
+{
+    HotplugEvent *ev = g_new0 (HotplugEvent, 1);
+
+    ev->type = type;
+    ev->udi = g_strdup (udi);
+    ev->time = get_time_us () / G_USEC_PER_SEC;
+    g_queue_push_tail (hotplug_events, ev);
+}
+
+static void free_hotplug_event (gpointer data, gpointer user_data)
+{
+    HotplugEvent *ev = data;
+
+    g_free (ev->udi);
+    g_free (ev);
+}
+
+static void free_device_state (gpointer data)
+{
+    DeviceState *ds = data;
 
-    length = (((unsigned) buff[0] & 255) << 8) + ((unsigned) buff[1] & 255);
-    buff[length] = '\0';
-    close (fd);
-    return g_strdup (buff + 2);
+    g_free (ds->uri);
+    g_free (ds);
 }
 
 /*
- * Find the corresponding usb backend printer for the given hal
- * printer.  The returned string needs to be freed by the caller.
+ * HAL callbacks.  We only queue the events here, they're handled
+ * from the main loop once the signal has been dispatched.
  */
-static gchar *hal_to_usb_uri (PrinterInfo *hp)
+static void hal_device_added (LibHalContext *ctx, const char *udi)
 {
-    GSList *detected = NULL, *d = NULL;
-    gchar *ret = NULL;
+    trace_add (TRACE_HAL_CALLS, 1);
+    if (!libhal_device_query_capability (ctx, udi, "printer", NULL))
+        return;
 
-    get_detected_printers (&detected);
-    if (!detected) {
-        log_it ("There are no local printers detected\n");
-        return NULL;
-    }
+    /* so that a remove before the add is handled isn't ignored */
+    if (!g_hash_table_lookup (hal_printers, udi))
+        g_hash_table_insert (hal_printers, g_strdup (udi), g_new0 (DeviceState, 1));
 
-    for (d = detected; d; d = d->next) {
-        PrinterInfo *pi = d->data;
-        
-        /* use IEEE 1284 ids to match if we can */
-        if (pi->device_id) {
-            gchar *dev_file = libhal_device_get_property_string (hal_ctx, hp->uri + 6,
-                                                                 "linux.device_file", NULL);
-            if (dev_file) {
-                gchar *ieee_id = get_1284_id_from_device (dev_file);
-                g_free (dev_file);
-
-                if (ieee_id) {
-                    gboolean match = match_by_1284 (pi->device_id, ieee_id);
-                    
-                    log_it ("Trying to match 1284 ids '%s' and '%s'\n", pi->device_id, ieee_id);
-                    g_free (ieee_id);
-                    
-                    if (match) {
-                        log_it ("1284 ids matched for '%s' and '%s'\n", pi->uri, hp->uri);
-                        ret = g_strdup (pi->uri);
-                        goto done;
-                    } else {
-                        log_it ("1284 ids didn't match\n");
-                        continue;
-                    }
-                }
-            }
-        }
+    queue_hotplug_event (HOTPLUG_ADD, udi);
+}
 
-        /* no 1284 id so we have to use string matching */
-        log_it ("no 1284 ids, using string matching\n");
-        if (printer_matches_hal_properties (pi, hp->uri + 6)) {
-            log_it ("strings matched hal uri '%s'\n", hp->uri);
-            ret = g_strdup (pi->uri);
-            break;
-        } 
-    }
+static void hal_device_removed (LibHalContext *ctx, const char *udi)
+{
+    /* the device is gone, so we can only tell it was a printer by
+     * having seen it before */
+    if (!g_hash_table_lookup (hal_printers, udi))
+        return;
 
-done:
-    g_slist_foreach (detected, free_printer_info, NULL);
-    g_slist_free (detected);
-    return ret;
+    queue_hotplug_event (HOTPLUG_REMOVE, udi);
+}
+
+static void handle_quit_signal (int sig)
+{
+    daemon_quit = 1;
 }
 
 /*
- * Find matching ppd-name given a ppd make and model
+ * The daemon's clock.  It's monotonic, so setting the system clock
+ * doesn't stall the coalesce window or release held devices early.
  */
-static gchar *find_matching_ppd (const gchar *ppd_make_and_model)
+static gint64 get_time_ms (void)
 {
-    gchar *p, *ppd = NULL;
-    gchar *mm = g_strdup (ppd_make_and_model);
-    ipp_t *request, *response;
-    ipp_attribute_t *attr;
-
-    /*
-     * The printer-make-and-model returned by CUPS might contain this crap 
-     */
-    p = strstr (mm, " (recommended)");
-    if (p)
-        *p = '\0';
+    return get_time_us () / 1000;
+}
 
-    request = ippNewRequest (CUPS_GET_PPDS);
-    response = cupsDoRequest (global_cups_connection, request, "/");
-    if (!response || response->request.status.status_code > IPP_OK_CONFLICT) {
-        log_it ("Failed to get ppds\n");
-        goto done;
+/*
+ * Record the event on the device's state, and hold the device if
+ * it has been changing state too often.
+ */
+static void apply_hotplug_event (HotplugEvent *ev)
+{
+    DeviceState *ds = g_hash_table_lookup (hal_printers, ev->udi);
+    gboolean present = ev->type == HOTPLUG_ADD;
+
+    if (!ds) {
+        ds = g_new0 (DeviceState, 1);
+        g_hash_table_insert (hal_printers, g_strdup (ev->udi), ds);
+    } else if (ds->present == present) {
+        return;
     }
- 
-    for (attr = response->attrs; attr; attr = attr ? attr->next : NULL) {
-        gchar *name = NULL, *make_and_model = NULL;
-        
-        while (attr && attr->group_tag != IPP_TAG_PRINTER)
-            attr = attr->next;
 
-        if (!attr)
-            goto done;
+    ds->present = present;
+    if (ev->time - ds->first_change >= config->flap_hold_time) {
+        ds->first_change = ev->time;
+        ds->changes = 0;
+    }
 
-        for (; attr && attr->group_tag == IPP_TAG_PRINTER; attr = attr->next) {
-            if (!strcmp (attr->name, "ppd-name") && attr->value_tag == IPP_TAG_NAME) {
-                name = attr->values[0].string.text;
-            } else if (!strcmp (attr->name, "ppd-make-and-model") && attr->value_tag == IPP_TAG_TEXT) {
-                make_and_model = attr->values[0].string.text;
-                p = strstr (make_and_model, " (recommended)");
-                if (p)
-                    *p = '\0';
-            } 
-        }
+    /* showing up for the first time isn't a change */
+    if (ds->last_change)
+        ds->changes++;
+    ds->last_change = ev->time;
 
-        log_it ("find_matching_ppd: comparing '%s' and '%s'\n", mm, make_and_model);
-        if (!g_ascii_strcasecmp (mm, make_and_model)) {
-            ppd = g_strdup (name);
-            break;
-        }
+    if (!ds->held && config->flap_threshold > 0 && ds->changes >= config->flap_threshold) {
+        log_it ("'%s' keeps coming and going, holding it\n", ev->udi);
+        ds->held = TRUE;
     }
-
-done:
-    g_free (mm);
-    ippDelete (response);
-    return ppd;
 }
 
+typedef struct _Reconcile {
+    time_t now;
+    GPtrArray *added;
+    GHashTable *keep;
+    gboolean removed;
+} Reconcile;
+
 /*
- * Move all hal backend printers to the usb backend.
+ * Work out what needs doing for a device.  Held devices are released
+ * once they've been stable for flap_hold_time seconds.  Until then
+ * nothing is done for them, and their queues are left as they are.
  */
-static gboolean migrate_hal_printers (void)
+static void reconcile_device (gpointer key, gpointer value, gpointer user_data)
 {
-    GSList *configured = NULL, *c = NULL;
-    gboolean ret = FALSE;
+    DeviceState *ds = value;
+    Reconcile *r = user_data;
 
-    get_cups_printers (&configured);
-    if (!configured)
-        return TRUE;
-    
-    for (c = configured; c; c = c->next) {
-        gchar *ppd_file, *usb_uri;
-        PrinterInfo *tmp = c->data;
+    if (ds->held && r->now - ds->last_change >= config->flap_hold_time) {
+        log_it ("'%s' has settled down\n", (gchar *) key);
+        ds->held = FALSE;
+        ds->changes = 0;
+    }
 
-        if (strncmp (tmp->uri, "hal://", 6))
-            continue;
+    if (ds->held) {
+        if (ds->uri)
+            g_hash_table_insert (r->keep, ds->uri, ds);
+        return;
+    }
 
-        usb_uri = hal_to_usb_uri (tmp);
-        if (!usb_uri)
-            continue;
+    if (ds->present == ds->applied)
+        return;
 
-        log_it ("hal uri '%s' matched uri '%s'\n", tmp->uri, usb_uri);
-        ppd_file = find_matching_ppd (tmp->make_and_model);
-        if (!ppd_file) {
-            log_it ("Failed to find matching ppd for '%s' '%s'\n", tmp->uri, tmp->make_and_model);
-            goto done;
-        }
-            
-        log_it ("Found matching ppd '%s'\n", ppd_file);
-        if (!remove_print_queue (tmp->name)) {
-            log_it ("Failed to remove hal print queue\n");
-        } else {
-            if (!add_print_queue (usb_uri, ppd_file, tmp->name)) {
-                log_it ("Failed to add usb print queue\n");
-            }
-        }
+    if (ds->present)
+        g_ptr_array_add (r->added, key);
+    else
+        r->removed = TRUE;
 
-        g_free (usb_uri);
-        g_free (ppd_file);
-    }
+    ds->applied = ds->present;
+}
 
-    ret = TRUE;
+static gboolean forget_device (gpointer key, gpointer value, gpointer user_data)
+{
+    DeviceState *ds = value;
+    Reconcile *r = user_data;
 
-done:
-    g_slist_foreach (configured, free_printer_info, NULL);
-    g_slist_free (configured);
-    return ret;
+    return !ds->present && !ds->applied && !ds->held && ds->last_change &&
+           r->now - ds->last_change >= config->flap_hold_time;
 }
 
 /*
- * Get printer information from HAL, cups, and the cups backends
- * and add the new printer, if necessary.
+ * Bring the print queues in line with the devices that changed since
+ * the last pass, with one pass over the backends and cups for all of
+ * them.
  */
-static gboolean add_printers (void)
+static void reconcile_devices (void)
 {
-    const gchar *udi = g_getenv ("HAL_PROP_INFO_UDI");
-    char **printers;
-    GSList *detected = NULL, *configured = NULL, *d = NULL, *c = NULL;
-    gboolean ret = FALSE;
-    int i, n;
-    
-    if (!config->add) {
-        g_print ("skipping, CUPS_AUTOCONFIG_ENABLE is not yes\n");
-        return TRUE;
-    }
+    GTimer *timer;
+    TraceSpan span;
+    Reconcile r;
+    gchar **uris;
+    gsize used;
+    gint i;
 
-    get_cups_printers (&configured);
-    get_detected_printers (&detected);
-    if (!detected) {
-        log_it ("Failed to detect backend printers\n");
+    reap_stray_children ();
+
+    r.now = get_time_us () / G_USEC_PER_SEC;
+    r.added = g_ptr_array_new ();
+    r.keep = g_hash_table_new (g_str_hash, g_str_equal);
+    r.removed = FALSE;
+    g_hash_table_foreach (hal_printers, reconcile_device, &r);
+
+    if (!r.added->len && !r.removed)
         goto done;
-    }
 
-    if (!udi) {
-        printers = libhal_find_device_by_capability (hal_ctx, "printer", &n, NULL);
-    } else {
-        printers = g_malloc (sizeof (char *));
-        printers[0] = g_strdup (udi); 
-        n = 1;
-    }
-   
-    for (i = 0; i < n; i++) {
-        PrinterInfo *new_printer = NULL, *old_printer = NULL;
-        gchar *ppd, *name;
+    timer = g_timer_new ();
+    trace_begin (&span);
+    ppd_index_refresh ();
+    invalidate_detected_printers ();
+    hal_forget_properties ();
 
-        /* see if the detected printer matches our hal printer */
-        for (d = detected; d; d = d->next) {
-            if (printer_matches_hal_properties (d->data, printers[i])) {
-                new_printer = d->data;
-                break;
-            } 
-        }
-       
-        if (!new_printer) {
-            log_it ("Failed to find a printer that matches HAL properties\n");
-            continue;
-        }
+    if (r.removed) {
+        log_it ("Printers were removed\n");
+        if (!disable_printers (r.keep))
+            log_error ("Failed to disable printers\n");
+    }
 
-        /* see if the printer is configured already */
-        for (c = configured; c; c = c->next) {
-            PrinterInfo *tp = c->data;
-            if (!strcmp (tp->uri, new_printer->uri)) {
-                old_printer = tp;
-                break;
-            }
-        }
+    if (r.added->len) {
+        log_it ("%d printers were added\n", r.added->len);
+        if (!migrate_hal_printers ())
+            log_error ("Failed to migrate hal printers\n");
 
-        /* make sure this printer is enabled */
-        if (old_printer) {
-            log_it ("Enabling old printer '%s'\n", old_printer->name);
-            set_printer_status (old_printer->name, TRUE);
-            set_printer_configured_existing_property (printers[i], name);
-            continue;
-        }
-       
-        /* try and find a ppd for the new printer */
-        ppd = get_best_ppd (new_printer);
-        if (!ppd) {
-            log_it ("Failed to find PPD file for printer\n");
-            continue;
-        }
+        uris = g_new0 (gchar *, r.added->len);
+        if (!add_printers ((const gchar * const *) r.added->pdata, r.added->len, uris))
+            log_error ("Failed to add printers\n");
 
-        log_it ("selected ppd file is '%s'\n", ppd);
-        name = generate_printer_name (new_printer, configured);
-        if (add_print_queue (new_printer->uri, ppd, name)) {
-            set_printer_configured_property (printers[i], name);
-        } else {
-            log_it ("Failed to add print queue\n");
+        for (i = 0; i < r.added->len; i++) {
+            DeviceState *ds = g_hash_table_lookup (hal_printers, g_ptr_array_index (r.added, i));
+            if (uris[i]) {
+                g_free (ds->uri);
+                ds->uri = uris[i];
+            }
         }
-
-        g_free (ppd);
-        g_free (name);
+        g_free (uris);
     }
 
-    if (!udi) {
-        libhal_free_string_array (printers);
-    } else {
-        g_free (printers[0]);
-        g_free (printers);
-    }
+    /* nothing from this pass is needed by the next one */
+    used = arena.used;
+    free_detected_printers ();
+    arena_reset ();
 
-    ret = TRUE;
+    trace_end (&span, "reconcile_devices");
+    log_it ("Handled events in %.3f seconds, released %lu bytes, rss %lu kB\n",
+            g_timer_elapsed (timer, NULL), (gulong) used, get_rss ());
+    g_timer_destroy (timer);
 
 done:
-    g_slist_foreach (detected, free_printer_info, NULL);
-    g_slist_free (detected);
-    g_slist_foreach (configured, free_printer_info, NULL);
-    g_slist_free (configured);
-    return ret;
+    g_hash_table_foreach_remove (hal_printers, forget_device, &r);
+    g_hash_table_destroy (r.keep);
+    g_ptr_array_free (r.added, TRUE);
+}
+
+static void count_held (gpointer key, gpointer value, gpointer user_data)
+{
+    DeviceState *ds = value;
+
+    if (ds->held)
+        (*(gint *) user_data)++;
 }
 
 /*
- * Look at the list of detected printers and the list of
- * cups configured printers and disable the print queues
- * for the printers that aren't present.
+ * Stay running and handle the HAL printer add and remove signals
+ * ourselves instead of being run from the HAL callouts.  Events are
+ * collected for coalesce_window milliseconds after the first one
+ * and then handled together.
  */
-static gboolean disable_printers (void)
+static gboolean run_daemon (DBusConnection *bus)
 {
-    GSList *detected = NULL, *configured = NULL, *c = NULL;
-    gboolean ret = TRUE;
-    
-    if (!config->remove) {
-        g_print ("skipping, CUPS_AUTOCONFIG_DISABLE is not 'yes'\n");
-        return TRUE;
-    }
-    
-    get_cups_printers (&configured);
-    if (!configured) {
-        g_print ("There are no configured printers, nothing to do\n");
-        return TRUE;
-    }
+    gchar **udis, *pid;
+    gint i, n;
+    gint64 deadline = 0;
+    gboolean ret = FALSE;
 
-    get_detected_printers (&detected);
-    
-    for (c = configured; c; c = c->next) {
-        GSList *d = NULL;
-        gboolean found = FALSE;
-        PrinterInfo *pi = c->data;
+    if (daemon_is_running ()) {
+        log_error ("cups-autoconfig is already running\n");
+        return FALSE;
+    }
 
-        if (!uri_is_local (pi->uri))
+    pid = g_strdup_printf ("%d\n", getpid ());
+    if (!g_file_set_contents (PID_FILE, pid, -1, NULL))
+        log_error ("Failed to write '%s'\n", PID_FILE);
+    g_free (pid);
+
+    signal (SIGTERM, handle_quit_signal);
+    signal (SIGINT, handle_quit_signal);
+
+    hotplug_events = g_queue_new ();
+    hal_printers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, free_device_state);
+
+    /* the printers that were attached before we started get added
+     * by the first pass */
+    udis = get_hal_printers (&n);
+    for (i = 0; i < n; i++)
+        queue_hotplug_event (HOTPLUG_ADD, udis[i]);
+    if (udis)
+        libhal_free_string_array (udis);
+
+    libhal_ctx_set_device_added (hal_ctx, hal_device_added);
+    libhal_ctx_set_device_removed (hal_ctx, hal_device_removed);
+
+    while (!daemon_quit) {
+        gint64 now = get_time_ms ();
+        gint timeout = DAEMON_DISPATCH_TIMEOUT, held = 0;
+        HotplugEvent *ev;
+
+        if (!deadline && !g_queue_is_empty (hotplug_events))
+            deadline = now + MAX (config->coalesce_window, 0);
+
+        if (deadline && now >= deadline) {
+            deadline = 0;
+            while ((ev = g_queue_pop_head (hotplug_events))) {
+                apply_hotplug_event (ev);
+                free_hotplug_event (ev, NULL);
+            }
+            reconcile_devices ();
             continue;
+        }
 
-        for (d = detected; d; d = d->next) {
-            PrinterInfo *dp = d->data;
-            if (!strcmp (dp->uri, pi->uri)) {
-                found = TRUE;
-                break;
-            }
+        if (deadline)
+            timeout = MIN (deadline - now, DAEMON_DISPATCH_TIMEOUT);
+
+        if (!dbus_connection_read_write_dispatch (bus, timeout)) {
+            log_error ("Lost the connection to the system bus\n");
+            goto done;
         }
-        
-        if (found)
-            continue;
 
-        if (!set_printer_status (pi->name, FALSE))
-            ret = FALSE;
+        /* let go of the devices that have settled down */
+        g_hash_table_foreach (hal_printers, count_held, &held);
+        if (held && !deadline)
+            reconcile_devices ();
     }
 
-    g_slist_foreach (detected, free_printer_info, NULL);
-    g_slist_free (detected);
-    g_slist_foreach (configured, free_printer_info, NULL);
-    g_slist_free (configured);
+    log_it ("Exiting\n");
+    ret = TRUE;
+
+done:
+    libhal_ctx_set_device_added (hal_ctx, NULL);
+    libhal_ctx_set_device_removed (hal_ctx, NULL);
+    g_queue_foreach (hotplug_events, free_hotplug_event, NULL);
+    g_queue_free (hotplug_events);
+    g_hash_table_destroy (hal_printers);
+    g_unlink (PID_FILE);
     return ret;
 }
 
@@ -1440,8 +5455,12 @@ int main (int argc, char *argv[])
     GOptionContext *ctx = NULL;
     GError *err = NULL;
     DBusError error;
-    gboolean add_cmd = FALSE, disable_cmd = FALSE;
-    gboolean ret = FALSE, is_add_enabled = FALSE, migrate = FALSE;
+    DBusConnection *bus;
+    TraceSpan span;
+    gchar *trace_file = NULL;
+    gboolean add_cmd = FALSE, disable_cmd = FALSE, daemon_cmd = FALSE;
+    gboolean reconcile_cmd = FALSE, dry_run = FALSE;
+    gboolean ret = FALSE, is_add_enabled = FALSE, migrate = FALSE, connected;
 
     GOptionEntry entries[] = {
         { "add", 0, 0, G_OPTION_ARG_NONE, &add_cmd, "Add new printers", NULL },
@@ -1450,6 +5469,14 @@ int main (int argc, char *argv[])
         { "migrate-hal-printers", 0, 0, G_OPTION_ARG_NONE, &migrate, "Migrate HAL backend printers", NULL },
         { "is-add-enabled", 0, 0, G_OPTION_ARG_NONE, &is_add_enabled,
           "Check if the ConfigureNewPrinters option is set", NULL },
+        { "daemon", 0, 0, G_OPTION_ARG_NONE, &daemon_cmd,
+          "Keep running and handle printer events from HAL", NULL },
+        { "reconcile", 0, 0, G_OPTION_ARG_NONE, &reconcile_cmd,
+          "Bring all the print queues in line with the attached printers in one go", NULL },
+        { "dry-run", 0, 0, G_OPTION_ARG_NONE, &dry_run,
+          "With --reconcile, only print what would be done", NULL },
+        { "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace_file,
+          "Write a Chrome trace of the run to FILE", "FILE" },
         { NULL, 0, 0, 0, NULL, NULL, NULL }
     };
 
@@ -1463,50 +5490,87 @@ int main (int argc, char *argv[])
     ctx = g_option_context_new ("");
     g_option_context_add_main_entries (ctx, entries, NULL);
     if (!g_option_context_parse (ctx, &argc, &argv, &err)) {
-        log_it ("parsing failed: %s\n", err->message);
+        log_error ("parsing failed: %s\n", err->message);
         g_error_free (err);
         goto done;
     }
 
+    if (trace_file)
+        trace_events = g_array_new (FALSE, FALSE, sizeof (TraceEvent));
+
     if (geteuid () != 0) {
-        log_it ("You must be root to run %s\n", argv[0]);
+        log_error ("You must be root to run %s\n", argv[0]);
         goto done;
     }
 
     if (!load_config ()) {
-        log_it ("Failed to load config file\n");
+        log_error ("Failed to load config file\n");
+        goto done;
+    }
+
+    /* build_plan() moves the hal:// queues when reconciling */
+    if (reconcile_cmd)
+        migrate = FALSE;
+
+    /* the daemon handles the events the callouts would */
+    if ((add_cmd || disable_cmd || migrate || (reconcile_cmd && !dry_run)) &&
+        daemon_is_running ()) {
+        g_print ("skipping, the cups-autoconfig daemon is running\n");
+        ret = TRUE;
         goto done;
     }
     
     load_vendor_mappings ();
     
-    if (!cups_connect ()) {
-        log_it ("Failed to connect to CUPS\n");
+    trace_begin (&span);
+    connected = cups_connect ();
+    trace_end (&span, "cups_connect");
+    if (!connected) {
+        log_error ("Failed to connect to CUPS\n");
         goto done;
     }
 
     if (!(hal_ctx = libhal_ctx_new ())) {
-        log_it ("Unable to create HAL context\n");
+        log_error ("Unable to create HAL context\n");
         goto done;
     }
 	
     dbus_error_init (&error);
-    libhal_ctx_set_dbus_connection (hal_ctx, dbus_bus_get (DBUS_BUS_SYSTEM, &error));
+    bus = dbus_bus_get (DBUS_BUS_SYSTEM, &error);
+    if (!bus) {
+        log_error ("Unable to connect to the system bus: %s\n", error.message);
+        dbus_error_free (&error);
+        goto done;
+    }
+
+    libhal_ctx_set_dbus_connection (hal_ctx, bus);
 	
-    if (!libhal_ctx_init (hal_ctx, &error)) {
-        log_it ("Unable to init HAL context: %s\n", error.message);
+    trace_begin (&span);
+    connected = libhal_ctx_init (hal_ctx, &error);
+    trace_end (&span, "hal_connect");
+    if (!connected) {
+        log_error ("Unable to init HAL context: %s\n", error.message);
         dbus_error_free (&error);
         goto done;
     }
 
+    if (daemon_cmd) {
+        ret = run_daemon (bus);
+        goto done;
+    }
+
     if (migrate && !migrate_hal_printers ())
-        log_it ("Failed to migrate hal printers\n");
+        log_error ("Failed to migrate hal printers\n");
+
+    if (reconcile_cmd) {
+        ret = reconcile_printers (dry_run);
+    } else if (add_cmd) {
+        const gchar *udi = g_getenv ("HAL_PROP_INFO_UDI");
 
-    if (add_cmd) {
-        if (add_printers ())
+        if (add_printers (udi ? &udi : NULL, 1, NULL))
             ret = TRUE;
     } else if (disable_cmd) {
-        ret = disable_printers ();
+        ret = disable_printers (NULL);
     } else if (is_add_enabled) {
         ret = config->add;
     } else if (migrate) {
@@ -1524,6 +5588,14 @@ done:
         libhal_ctx_free (hal_ctx);
     }
     
+    free_detected_printers ();
+    arena_reset ();
+    hal_forget_properties ();
+    if (device_ids)
+        g_hash_table_destroy (device_ids);
+    if (fingerprints)
+        g_key_file_free (fingerprints);
+    ppd_index_close ();
     cups_disconnect ();
 
     if (ctx)
@@ -1531,9 +5603,14 @@ done:
 
     if (config)
         free_config ();
-    
-    if (log_file)
-        fclose (log_file);
-    
+
+    if (trace_events) {
+        trace_write (trace_file);
+        g_array_free (trace_events, TRUE);
+    }
+
+    g_free (trace_file);
+    close_log ();
+
     return ret ? 0 : 1;
 }